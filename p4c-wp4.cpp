@@ -29,6 +29,7 @@ limitations under the License.
 #include "wp4-Midend.h"
 #include "wp4-Options.h"
 #include "wp4-Backend.h"
+#include "wp4-BinaryIR.h"
 #include "frontends/common/applyOptionsPragmas.h"
 #include "frontends/common/parseInput.h"
 #include "frontends/p4/frontend.h"
@@ -44,7 +45,11 @@ void compile(WP4Options& options) {
     }
     const IR::P4Program *program = nullptr;
 
-    if (options.loadIRFromJson) {
+    if (options.loadIRFromBinary) {
+        program = WP4::BinaryIR::load(options.file);
+        if (program == nullptr)
+            return;
+    } else if (options.loadIRFromJson) {
         std::filebuf fb;
         if (fb.open(options.file, std::ios::in) == nullptr) {
             ::error("%s: No such file or directory.", options.file);
@@ -78,6 +83,8 @@ void compile(WP4Options& options) {
     auto toplevel = midend.run(options, program);
     if (options.dumpJsonFile)
         JSONGenerator(*openFile(options.dumpJsonFile, true)) << program << std::endl;
+    if (options.dumpBinaryIRFile)
+        WP4::BinaryIR::save(program, options.dumpBinaryIRFile);
     if (::errorCount() > 0)
         return;
 
@@ -15,6 +15,27 @@ limitations under the License.
 */
 
 #include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/uaccess.h>
+#include <linux/crc32.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/jhash.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/ioctl.h>
+#include <linux/seqlock.h>
+#include <linux/skbuff.h>
+#include <linux/llist.h>
+#include <linux/interrupt.h>
+#include <asm/unaligned.h>
 
 #define MAX_FLOWS    512
 #define SHARED_BUFFER_LEN 16384
@@ -39,6 +60,206 @@ struct flows_counter
     int lastmatch;
 };
 
+/* One element of a counter extern, 4 to a cache line.  Each CPU counts
+ * into its own copy, so the fast path is a single this_cpu_inc/add. */
+struct wp4_counter
+{
+    u64 packets;
+    u64 bytes;
+};
+
+/* A counter array exported through debugfs */
+struct wp4_counter_set
+{
+    struct wp4_counter __percpu *counters;
+    u32 size;
+};
+
+/* Token bucket of a meter extern, as the equivalent GCRA: 'tat' is the
+ * theoretical arrival time in nanoseconds, which each conforming frame
+ * pushes 'units' tokens' worth of time ahead; a frame that would push it
+ * more than 'burst' tokens' worth past now is RED.  It is a single 64-bit
+ * word, so a frame is policed with one cmpxchg and no lock, and an idle
+ * bucket is full again however long it was idle.  burst 0 means the meter
+ * is not configured and passes everything. */
+struct wp4_meter
+{
+    atomic64_t tat;
+    u32 rate;           /* tokens per second */
+    u64 tolerance;      /* ns: burst tokens at 'rate' */
+};
+
+#define WP4_METER_GREEN 0
+#define WP4_METER_RED   1
+
+/* Written to a meter's debugfs file to configure element 'index' */
+struct wp4_meter_config
+{
+    u32 index;
+    u32 rate;
+    u32 burst;
+};
+
+struct wp4_meter_set
+{
+    struct wp4_meter *meters;
+    u32 size;
+};
+
+/* Bucketized cuckoo hash table: every key lives in one of the four ways of
+ * one of its two buckets, so a lookup fetches two tag words and compares
+ * only the entries whose tag byte matches.  The second bucket is derived
+ * from the first and the tag (partial-key cuckoo hashing), which lets an
+ * entry be moved without its key being rehashed. */
+#define WP4_CUCKOO_WAYS      4
+#define WP4_CUCKOO_MAX_KICKS 128
+
+struct wp4_cuckoo
+{
+    u32 *tags;          /* one byte per way, 0 if the way is empty */
+    u8 *entries;        /* the key followed by the value, per way */
+    u32 mask;           /* buckets - 1 */
+    u32 key_size;
+    u32 value_offset;
+    u32 value_size;
+    u32 entry_size;
+    u32 count;
+    u32 stamp_offset;       /* of the last-hit jiffies in an entry, 0 if entries do not age */
+    unsigned long timeout;  /* idle jiffies after which an entry expires */
+    spinlock_t lock;    /* serializes updates */
+    seqcount_t seq;     /* lookups retry if an update moved entries */
+};
+
+/* Radio metadata of a monitor-mode frame, from its radiotap header.
+ * Fields the header does not carry are 0. */
+struct wp4_radiotap
+{
+    u64 timestamp;      /* TSFT, microseconds */
+    u16 channel_freq;   /* MHz */
+    u16 channel_flags;
+    u8 rate;            /* 500 kbit/s */
+    s8 rssi;            /* antenna signal, dBm */
+};
+
+#define WP4_RADIOTAP_TSFT           0
+#define WP4_RADIOTAP_FLAGS          1
+#define WP4_RADIOTAP_RATE           2
+#define WP4_RADIOTAP_CHANNEL        3
+#define WP4_RADIOTAP_FHSS           4
+#define WP4_RADIOTAP_DBM_ANTSIGNAL  5
+#define WP4_RADIOTAP_EXT            31
+
+/* Ports a frame can be replicated to; higher ones only take single frames */
+#define WP4_EGRESS_PORTS 256
+
+/* Where the deparsed frame goes: 'ports' is a bitmap of the ports to
+ * replicate it to, or empty for the single port 'port' */
+struct wp4_egress
+{
+    DECLARE_BITMAP(ports, WP4_EGRESS_PORTS);
+    u32 port;
+    u8 queue;
+    u8 ac;              /* WMM ACI: 0 BE, 1 BK, 2 VI, 3 VO */
+};
+
+/* Transmits the frame on a port and consumes it; set by the driver */
+typedef int (*wp4_xmit_t)(struct sk_buff *skb, u32 port);
+
+/* wp4_packet_in return codes */
+#define WP4_FORWARD   0     /* the caller forwards the frame */
+#define WP4_DROP      1     /* the caller frees the frame */
+#define WP4_CONSUMED  2     /* the frame went to the transmit hook */
+
+/* Egress scheduler: one queue per WMM access category, served by deficit
+ * round robin in a tasklet, voice first.  Any CPU adds frames to a queue
+ * with a lock-free llist; the tasklet, which never runs on two CPUs at
+ * once, is the only consumer.  Each round gives an AC its quantum of bytes
+ * (airtime is not known before the driver picks a rate), so voice is not
+ * stuck behind a backlog of bulk frames and bulk still gets its share. */
+#define WP4_SCHED_ACS       4
+#define WP4_SCHED_LIMIT     1024    /* frames queued per AC */
+#define WP4_SCHED_BUDGET    64      /* frames sent per tasklet run */
+
+struct wp4_sched_queue
+{
+    struct llist_head in;       /* frames added since the last run */
+    struct sk_buff_head out;    /* in order; touched only by the tasklet */
+    atomic_t backlog;
+    u32 quantum;
+    u32 deficit;
+};
+
+struct wp4_sched
+{
+    struct wp4_sched_queue queues[WP4_SCHED_ACS];   /* by ACI */
+    struct tasklet_struct tasklet;
+    wp4_xmit_t *xmit;
+};
+
+/* the output port of a queued frame */
+#define WP4_SCHED_PORT(skb) (*(u32 *)(skb)->cb)
+
+/* Control-plane operations on a table: struct <table>_update records
+ * {u32 op; key; value} written to /sys/kernel/debug/wp4_tables/<table>.
+ * Keep in sync with the generated control-plane header. */
+#define WP4_TABLE_ADD           1   /* -EEXIST if the key is present */
+#define WP4_TABLE_MODIFY        2   /* -ENOENT if it is not */
+#define WP4_TABLE_DELETE        3   /* -ENOENT if it is not */
+#define WP4_TABLE_SET_DEFAULT   4   /* the key is ignored */
+
+/* WP4_TABLE_IOC_BATCH applies 'count' update records as one transaction:
+ * lookups see either none or all of them.  If one fails none is applied,
+ * and 'failed' is its index. */
+struct wp4_table_batch
+{
+    u64 records;        /* user pointer */
+    u32 count;
+    u32 failed;
+};
+
+#define WP4_TABLE_IOC_BATCH     _IOWR('W', 1, struct wp4_table_batch)
+#define WP4_TABLE_BATCH_MAX     (1 << 20)
+
+/* Full replacement: after WP4_TABLE_IOC_SHADOW, updates go to an empty
+ * shadow copy of the table, which lookups do not see, until
+ * WP4_TABLE_IOC_COMMIT makes it the table or WP4_TABLE_IOC_ABORT drops it.
+ * The shadow starts with the current default action. */
+#define WP4_TABLE_IOC_SHADOW    _IO('W', 2)
+#define WP4_TABLE_IOC_COMMIT    _IO('W', 3)
+#define WP4_TABLE_IOC_ABORT     _IO('W', 4)
+
+/* Fails with the error of the record at which the last write on this file
+ * stopped, without applying anything; succeeds if it did not stop */
+#define WP4_TABLE_IOC_ERROR     _IO('W', 5)
+
+/* A table as the control plane sees it.  'entries' is NULL for a table
+ * whose entries are not kept by the module, which only takes
+ * WP4_TABLE_SET_DEFAULT.  The default action is copied out by lookups,
+ * like the entries of a cuckoo table and under the same seqcount, so that
+ * a lookup sees the entries and the default action of one update; a table
+ * without entries uses 'default_seq'. */
+struct wp4_table
+{
+    struct wp4_cuckoo *entries;
+    u8 *default_value;
+    u32 value_size;
+    u32 key_offset;             /* in an update record */
+    u32 value_offset;
+    u32 record_size;
+    void (*invalidate)(void);   /* of the flow cache, or NULL */
+    struct mutex mutex;         /* serializes the control plane */
+    seqcount_t default_seq;
+    struct wp4_cuckoo *shadow;  /* being filled, or NULL */
+    u8 *shadow_default;
+};
+
+/* An open table file */
+struct wp4_table_file
+{
+    struct wp4_table *table;
+    int err;            /* of the record at which the last write stopped */
+};
+
 struct flow_table
 {
     int iLastFlow;
@@ -72,3 +293,1177 @@ struct pbuffer
     struct packet_buffer buffer[PACKET_BUFFER];
 };
 
+/* RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'), over 'words' 16-bit words */
+static inline u16 wp4_csum16_update(u16 csum, u64 old_value, u64 new_value, int words)
+{
+    u32 sum = (u16)~csum;
+    int i;
+
+    for (i = 0; i < words; i++) {
+        sum += (u16)~(old_value >> (16 * i));
+        sum += (u16)(new_value >> (16 * i));
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (u16)~sum;
+}
+
+/* Rewrites the FCS in the last four bytes of the frame.  crc32_le is the
+ * kernel's table-driven CRC, which uses PCLMULQDQ where the CPU has it. */
+static inline int wp4_fcs_update(struct sk_buff *skb)
+{
+    if (skb->len < 4 || skb_ensure_writable(skb, skb->len))
+        return -EINVAL;
+    put_unaligned_le32(~crc32_le(~0, skb->data, skb->len - 4),
+                       skb->data + skb->len - 4);
+    return 0;
+}
+
+/* Decodes the radiotap header that starts the frame into 'rt' and strips
+ * it; returns its length, or -EINVAL if it is malformed.  All the fields
+ * decoded belong to the low six bits of the first presence word, and their
+ * data comes first, so their offsets follow from those bits alone: the
+ * remaining bits and the extension words only move the start of the data,
+ * and no field past the antenna signal is ever walked. */
+static inline int wp4_radiotap_strip(struct sk_buff *skb, struct wp4_radiotap *rt)
+{
+    const u8 *data = skb->data;
+    u32 len, present, word, pos;
+    u32 tsft = 0, rate = 0, channel = 0, signal = 0;
+
+    memset(rt, 0, sizeof(*rt));
+    if (skb_headlen(skb) < 8 || data[0] != 0)
+        return -EINVAL;
+    len = get_unaligned_le16(data + 2);
+    if (len < 8 || len > skb_headlen(skb))
+        return -EINVAL;
+    present = word = get_unaligned_le32(data + 4);
+    pos = 8;
+    while (word & BIT(WP4_RADIOTAP_EXT)) {
+        if (pos + 4 > len)
+            return -EINVAL;
+        word = get_unaligned_le32(data + pos);
+        pos += 4;
+    }
+
+    /* fields are aligned to their size from the start of the header */
+    if (present & BIT(WP4_RADIOTAP_TSFT)) {
+        pos = ALIGN(pos, 8);
+        tsft = pos;
+        pos += 8;
+    }
+    if (present & BIT(WP4_RADIOTAP_FLAGS))
+        pos += 1;
+    if (present & BIT(WP4_RADIOTAP_RATE))
+        rate = pos++;
+    if (present & BIT(WP4_RADIOTAP_CHANNEL)) {
+        pos = ALIGN(pos, 2);
+        channel = pos;
+        pos += 4;
+    }
+    if (present & BIT(WP4_RADIOTAP_FHSS))
+        pos += 2;
+    if (present & BIT(WP4_RADIOTAP_DBM_ANTSIGNAL))
+        signal = pos++;
+    if (pos > len)
+        return -EINVAL;
+
+    /* offset 0 is the header itself, so it marks an absent field */
+    if (tsft)
+        rt->timestamp = get_unaligned_le64(data + tsft);
+    if (rate)
+        rt->rate = data[rate];
+    if (channel) {
+        rt->channel_freq = get_unaligned_le16(data + channel);
+        rt->channel_flags = get_unaligned_le16(data + channel + 2);
+    }
+    if (signal)
+        rt->rssi = (s8)data[signal];
+    skb_pull(skb, len);
+    return len;
+}
+
+static inline void wp4_sched_run(unsigned long data)
+{
+    /* ACIs by priority: VO, VI, BE, BK */
+    static const u8 order[WP4_SCHED_ACS] = { 3, 2, 0, 1 };
+    struct wp4_sched *s = (struct wp4_sched *)data;
+    wp4_xmit_t xmit = READ_ONCE(*s->xmit);
+    int budget = WP4_SCHED_BUDGET;
+    bool backlog = false;
+    int i;
+
+    for (i = 0; i < WP4_SCHED_ACS; i++) {
+        struct wp4_sched_queue *q = &s->queues[order[i]];
+        struct llist_node *batch = llist_del_all(&q->in);
+        struct sk_buff *skb, *next;
+
+        /* llist_add pushes at the head: restore arrival order */
+        batch = llist_reverse_order(batch);
+        llist_for_each_entry_safe(skb, next, batch, ll_node)
+            __skb_queue_tail(&q->out, skb);
+        if (skb_queue_empty(&q->out)) {
+            q->deficit = 0;
+            continue;
+        }
+        q->deficit += q->quantum;
+        while (budget > 0 && (skb = skb_peek(&q->out)) != NULL && skb->len <= q->deficit) {
+            __skb_unlink(skb, &q->out);
+            atomic_dec(&q->backlog);
+            q->deficit -= skb->len;
+            budget--;
+            if (xmit)
+                xmit(skb, WP4_SCHED_PORT(skb));
+            else
+                kfree_skb(skb);
+        }
+        if (skb_queue_empty(&q->out))
+            q->deficit = 0;
+        else
+            backlog = true;
+    }
+    if (backlog)
+        tasklet_schedule(&s->tasklet);
+}
+
+static inline void wp4_sched_init(struct wp4_sched *s, wp4_xmit_t *xmit)
+{
+    /* bytes per round for BE, BK, VI and VO */
+    static const u32 quantum[WP4_SCHED_ACS] = { 2 * 1536, 1536, 3 * 1536, 4 * 1536 };
+    int ac;
+
+    for (ac = 0; ac < WP4_SCHED_ACS; ac++) {
+        init_llist_head(&s->queues[ac].in);
+        skb_queue_head_init(&s->queues[ac].out);
+        atomic_set(&s->queues[ac].backlog, 0);
+        s->queues[ac].quantum = quantum[ac];
+        s->queues[ac].deficit = 0;
+    }
+    s->xmit = xmit;
+    tasklet_init(&s->tasklet, wp4_sched_run, (unsigned long)s);
+}
+
+static inline void wp4_sched_exit(struct wp4_sched *s)
+{
+    struct sk_buff *skb, *next;
+    int ac;
+
+    tasklet_kill(&s->tasklet);
+    for (ac = 0; ac < WP4_SCHED_ACS; ac++) {
+        llist_for_each_entry_safe(skb, next, llist_del_all(&s->queues[ac].in), ll_node)
+            kfree_skb(skb);
+        __skb_queue_purge(&s->queues[ac].out);
+    }
+}
+
+/* Queues the frame for 'port'; a full queue drops it */
+static inline void wp4_sched_enqueue(struct wp4_sched *s, struct sk_buff *skb, u32 port, u8 ac)
+{
+    struct wp4_sched_queue *q = &s->queues[ac % WP4_SCHED_ACS];
+
+    if (atomic_inc_return(&q->backlog) > WP4_SCHED_LIMIT) {
+        atomic_dec(&q->backlog);
+        kfree_skb(skb);
+        return;
+    }
+    WP4_SCHED_PORT(skb) = port;
+    llist_add(&skb->ll_node, &q->in);
+    tasklet_schedule(&s->tasklet);
+}
+
+static inline void wp4_egress_send(struct sk_buff *skb, u32 port, const struct wp4_egress *e,
+                                   wp4_xmit_t xmit, struct wp4_sched *sched)
+{
+    if (sched)
+        wp4_sched_enqueue(sched, skb, port, e->ac);
+    else
+        xmit(skb, port);
+}
+
+/* Sets the ports of 'e' from the output_ports field, a wide value */
+static inline void wp4_egress_set_ports(struct wp4_egress *e, const u8 *ports)
+{
+    u64 limbs[WP4_EGRESS_PORTS / 64];
+    u32 i;
+
+    for (i = 0; i < ARRAY_SIZE(limbs); i++)
+        limbs[i] = get_unaligned_le64(ports + 8 * i);
+    bitmap_from_arr64(e->ports, limbs, WP4_EGRESS_PORTS);
+}
+
+/* Sends the frame where 'e' says, through the scheduler if there is one.
+ * Replicas are clones: the deparser has already written the headers,
+ * which are the same for every port, so the copies share the frame data
+ * and only the skb heads are allocated.  The last port gets the original.
+ * Without a hook the caller forwards it. */
+static inline int wp4_egress(struct sk_buff *skb, const struct wp4_egress *e, wp4_xmit_t xmit,
+                             struct wp4_sched *sched)
+{
+    struct sk_buff *clone;
+    unsigned long last, port;
+
+    skb_set_queue_mapping(skb, e->queue);
+    if (xmit == NULL)
+        return WP4_FORWARD;
+    last = find_last_bit(e->ports, WP4_EGRESS_PORTS);
+    if (last == WP4_EGRESS_PORTS) {
+        wp4_egress_send(skb, e->port, e, xmit, sched);
+        return WP4_CONSUMED;
+    }
+    for_each_set_bit(port, e->ports, last) {
+        clone = skb_clone(skb, GFP_ATOMIC);
+        if (clone)
+            wp4_egress_send(clone, port, e, xmit, sched);
+    }
+    wp4_egress_send(skb, last, e, xmit, sched);
+    return WP4_CONSUMED;
+}
+
+/* debugfs read: returns the elements summed over all CPUs, in order */
+static inline ssize_t wp4_counter_read(struct file *file, char __user *buf,
+                                       size_t len, loff_t *ppos)
+{
+    struct wp4_counter_set *set = file->private_data;
+    struct wp4_counter sum;
+    size_t done = 0;
+    loff_t index;
+    int cpu;
+
+    if (*ppos % sizeof(sum))
+        return -EINVAL;
+    for (index = *ppos / sizeof(sum); index < set->size && len - done >= sizeof(sum); index++) {
+        sum.packets = 0;
+        sum.bytes = 0;
+        for_each_possible_cpu(cpu) {
+            struct wp4_counter *c = per_cpu_ptr(set->counters, cpu) + index;
+            sum.packets += READ_ONCE(c->packets);
+            sum.bytes += READ_ONCE(c->bytes);
+        }
+        if (copy_to_user(buf + done, &sum, sizeof(sum)))
+            return -EFAULT;
+        done += sizeof(sum);
+    }
+    *ppos += done;
+    return done;
+}
+
+/* Takes 'units' tokens from the bucket at time 'now' (microseconds) */
+static inline int wp4_meter_execute(struct wp4_meter *m, u32 units, u64 now)
+{
+    u64 tolerance = READ_ONCE(m->tolerance);
+    u32 rate = READ_ONCE(m->rate);
+    s64 old, tat;
+
+    if (tolerance == 0)
+        return WP4_METER_GREEN;
+    if (rate == 0)
+        return units ? WP4_METER_RED : WP4_METER_GREEN;
+    now *= NSEC_PER_USEC;
+    old = atomic64_read(&m->tat);
+    do {
+        tat = max_t(u64, old, now) + div_u64((u64)units * NSEC_PER_SEC, rate);
+        if (tat - now > tolerance)
+            return WP4_METER_RED;
+    } while (!atomic64_try_cmpxchg(&m->tat, &old, tat));
+    return WP4_METER_GREEN;
+}
+
+static inline u64 wp4_meter_now(void)
+{
+    return div_u64(ktime_get_ns(), 1000);
+}
+
+/* debugfs write: a sequence of struct wp4_meter_config; each one refills
+ * the bucket it configures */
+static inline ssize_t wp4_meter_write(struct file *file, const char __user *buf,
+                                      size_t len, loff_t *ppos)
+{
+    struct wp4_meter_set *set = file->private_data;
+    struct wp4_meter_config config;
+    struct wp4_meter *m;
+    size_t done = 0;
+
+    while (len - done >= sizeof(config)) {
+        if (copy_from_user(&config, buf + done, sizeof(config)))
+            return -EFAULT;
+        if (config.index >= set->size)
+            return -EINVAL;
+        m = &set->meters[config.index];
+        WRITE_ONCE(m->tolerance, 0);
+        WRITE_ONCE(m->rate, config.rate);
+        /* a time in the past: the bucket is full */
+        atomic64_set(&m->tat, 0);
+        if (config.burst)
+            WRITE_ONCE(m->tolerance, config.rate ?
+                       div_u64((u64)config.burst * NSEC_PER_SEC, config.rate) ?: 1 : 1);
+        done += sizeof(config);
+    }
+    *ppos += done;
+    return done;
+}
+
+/* Key equality for wide keys and header structs.  'size' is a constant at
+ * every call site, so the loop unrolls into a straight run of word loads,
+ * xors and ors with a single test at the end, where memcmp would be an
+ * out-of-line call that stops at the first differing byte. */
+static __always_inline bool wp4_key_equal(const void *a, const void *b, u32 size)
+{
+    const u8 *x = a, *y = b;
+    u64 diff = 0;
+    u32 i;
+
+    for (i = 0; i + 8 <= size; i += 8)
+        diff |= get_unaligned((const u64 *)(x + i)) ^ get_unaligned((const u64 *)(y + i));
+    if (size - i >= 4) {
+        diff |= get_unaligned((const u32 *)(x + i)) ^ get_unaligned((const u32 *)(y + i));
+        i += 4;
+    }
+    if (size - i >= 2) {
+        diff |= get_unaligned((const u16 *)(x + i)) ^ get_unaligned((const u16 *)(y + i));
+        i += 2;
+    }
+    if (size - i)
+        diff |= x[i] ^ y[i];
+    return diff == 0;
+}
+
+/* Values wider than 64 bits are u8 arrays holding the least significant
+ * byte first.  The wp4_wide_* helpers compute on them in u64 limbs; 'bits'
+ * is a constant at every call site, so the limb loops unroll.  Results are
+ * masked to 'bits', and operands may alias the destination. */
+#define WP4_WIDE_LIMBS(bits) DIV_ROUND_UP(bits, 64)
+
+static __always_inline u64 wp4_wide_get(const u8 *v, u32 bits, u32 i)
+{
+    u32 bytes = DIV_ROUND_UP(bits, 8), j;
+    u64 x = 0;
+
+    if (8 * i + 8 <= bytes)
+        return get_unaligned_le64(v + 8 * i);
+    for (j = 8 * i; j < bytes; j++)
+        x |= (u64)v[j] << (8 * (j - 8 * i));
+    return x;
+}
+
+static __always_inline void wp4_wide_set(u8 *v, u32 bits, u32 i, u64 x)
+{
+    u32 bytes = DIV_ROUND_UP(bits, 8), j;
+
+    if (i == WP4_WIDE_LIMBS(bits) - 1 && bits % 64)
+        x &= (1ULL << (bits % 64)) - 1;
+    if (8 * i + 8 <= bytes) {
+        put_unaligned_le64(x, v + 8 * i);
+        return;
+    }
+    for (j = 8 * i; j < bytes; j++)
+        v[j] = x >> (8 * (j - 8 * i));
+}
+
+static __always_inline void wp4_wide_from_u64(u8 *r, u64 x, u32 bits)
+{
+    u32 i;
+
+    for (i = 0; i < WP4_WIDE_LIMBS(bits); i++)
+        wp4_wide_set(r, bits, i, i ? 0 : x);
+}
+
+static __always_inline void wp4_wide_add(u8 *r, const u8 *a, const u8 *b, u32 bits)
+{
+    u64 x, s, carry = 0;
+    u32 i;
+
+    for (i = 0; i < WP4_WIDE_LIMBS(bits); i++) {
+        x = wp4_wide_get(a, bits, i);
+        s = x + wp4_wide_get(b, bits, i) + carry;
+        carry = carry ? s <= x : s < x;
+        wp4_wide_set(r, bits, i, s);
+    }
+}
+
+static __always_inline void wp4_wide_sub(u8 *r, const u8 *a, const u8 *b, u32 bits)
+{
+    u64 x, y, borrow = 0;
+    u32 i;
+
+    for (i = 0; i < WP4_WIDE_LIMBS(bits); i++) {
+        x = wp4_wide_get(a, bits, i);
+        y = wp4_wide_get(b, bits, i);
+        wp4_wide_set(r, bits, i, x - y - borrow);
+        borrow = borrow ? x <= y : x < y;
+    }
+}
+
+/* op is one of & | ^ */
+#define WP4_WIDE_BITWISE(name, op)                                              \
+static __always_inline void wp4_wide_##name(u8 *r, const u8 *a, const u8 *b, u32 bits) \
+{                                                                               \
+    u32 i;                                                                      \
+                                                                                \
+    for (i = 0; i < WP4_WIDE_LIMBS(bits); i++)                                  \
+        wp4_wide_set(r, bits, i, wp4_wide_get(a, bits, i) op wp4_wide_get(b, bits, i)); \
+}
+WP4_WIDE_BITWISE(and, &)
+WP4_WIDE_BITWISE(or, |)
+WP4_WIDE_BITWISE(xor, ^)
+
+static __always_inline void wp4_wide_not(u8 *r, const u8 *a, u32 bits)
+{
+    u32 i;
+
+    for (i = 0; i < WP4_WIDE_LIMBS(bits); i++)
+        wp4_wide_set(r, bits, i, ~wp4_wide_get(a, bits, i));
+}
+
+static __always_inline void wp4_wide_neg(u8 *r, const u8 *a, u32 bits)
+{
+    u64 x, borrow = 0;
+    u32 i;
+
+    for (i = 0; i < WP4_WIDE_LIMBS(bits); i++) {
+        x = wp4_wide_get(a, bits, i);
+        wp4_wide_set(r, bits, i, 0 - x - borrow);
+        borrow = borrow || x;
+    }
+}
+
+static __always_inline void wp4_wide_shl(u8 *r, const u8 *a, u32 n, u32 bits)
+{
+    u64 lo, hi;
+    int i;
+
+    for (i = WP4_WIDE_LIMBS(bits) - 1; i >= 0; i--) {
+        hi = i >= n / 64 ? wp4_wide_get(a, bits, i - n / 64) : 0;
+        lo = i > n / 64 ? wp4_wide_get(a, bits, i - n / 64 - 1) : 0;
+        wp4_wide_set(r, bits, i, n % 64 ? hi << (n % 64) | lo >> (64 - n % 64) : hi);
+    }
+}
+
+static __always_inline void wp4_wide_shr(u8 *r, const u8 *a, u32 n, u32 bits)
+{
+    u32 limbs = WP4_WIDE_LIMBS(bits), i;
+    u64 lo, hi;
+
+    for (i = 0; i < limbs; i++) {
+        lo = i + n / 64 < limbs ? wp4_wide_get(a, bits, i + n / 64) : 0;
+        hi = i + n / 64 + 1 < limbs ? wp4_wide_get(a, bits, i + n / 64 + 1) : 0;
+        wp4_wide_set(r, bits, i, n % 64 ? lo >> (n % 64) | hi << (64 - n % 64) : lo);
+    }
+}
+
+/* Truncates or zero-extends the abits-wide a to bits */
+static __always_inline void wp4_wide_resize(u8 *r, u32 bits, const u8 *a, u32 abits)
+{
+    u32 i;
+
+    for (i = 0; i < WP4_WIDE_LIMBS(bits); i++)
+        wp4_wide_set(r, bits, i, i < WP4_WIDE_LIMBS(abits) ? wp4_wide_get(a, abits, i) : 0);
+}
+
+/* The 64 bits of a starting at bit 'offset', zero-filled past the top */
+static __always_inline u64 wp4_wide_bits(const u8 *a, u32 bits, u32 offset)
+{
+    u32 i = offset / 64;
+    u64 x = 0;
+
+    if (i < WP4_WIDE_LIMBS(bits))
+        x = wp4_wide_get(a, bits, i) >> (offset % 64);
+    if (offset % 64 && i + 1 < WP4_WIDE_LIMBS(bits))
+        x |= wp4_wide_get(a, bits, i + 1) << (64 - offset % 64);
+    return x;
+}
+
+/* Returns <0, 0 or >0 as a is below, equal to or above b */
+static __always_inline int wp4_wide_cmp(const u8 *a, const u8 *b, u32 bits)
+{
+    u64 x, y;
+    int i;
+
+    for (i = WP4_WIDE_LIMBS(bits) - 1; i >= 0; i--) {
+        x = wp4_wide_get(a, bits, i);
+        y = wp4_wide_get(b, bits, i);
+        if (x != y)
+            return x < y ? -1 : 1;
+    }
+    return 0;
+}
+
+static inline int wp4_cuckoo_init(struct wp4_cuckoo *t, u32 size, u32 key_size,
+                                  u32 value_offset, u32 value_size, u32 entry_size)
+{
+    u32 buckets = roundup_pow_of_two(max_t(u32, DIV_ROUND_UP(size, WP4_CUCKOO_WAYS), 2));
+
+    t->tags = kvcalloc(buckets, sizeof(u32), GFP_KERNEL);
+    t->entries = kvcalloc((size_t)buckets * WP4_CUCKOO_WAYS, entry_size, GFP_KERNEL);
+    if (!t->tags || !t->entries) {
+        kvfree(t->tags);
+        kvfree(t->entries);
+        t->tags = NULL;
+        t->entries = NULL;
+        return -ENOMEM;
+    }
+    t->mask = buckets - 1;
+    t->key_size = key_size;
+    t->value_offset = value_offset;
+    t->value_size = value_size;
+    t->entry_size = entry_size;
+    t->count = 0;
+    t->stamp_offset = 0;
+    t->timeout = 0;
+    spin_lock_init(&t->lock);
+    seqcount_init(&t->seq);
+    return 0;
+}
+
+/* Entries of 't' expire after 'timeout_ms' without a hit; 'stamp_offset'
+ * is that of an unsigned long in the entry, which the table maintains */
+static inline void wp4_cuckoo_set_aging(struct wp4_cuckoo *t, u32 stamp_offset, u32 timeout_ms)
+{
+    t->stamp_offset = stamp_offset;
+    t->timeout = msecs_to_jiffies(timeout_ms);
+}
+
+static inline void wp4_cuckoo_free(struct wp4_cuckoo *t)
+{
+    kvfree(t->tags);
+    kvfree(t->entries);
+    t->tags = NULL;
+    t->entries = NULL;
+}
+
+static inline u8 wp4_cuckoo_tag(u32 hash)
+{
+    u8 tag = hash >> 24;
+    return tag ? tag : 1;
+}
+
+static inline u32 wp4_cuckoo_alt(struct wp4_cuckoo *t, u32 bucket, u8 tag)
+{
+    return (bucket ^ (tag * 0x5bd1e995u)) & t->mask;
+}
+
+static inline u8 *wp4_cuckoo_slot(struct wp4_cuckoo *t, u32 bucket, u32 way)
+{
+    return t->entries + ((size_t)bucket * WP4_CUCKOO_WAYS + way) * t->entry_size;
+}
+
+/* Index of the entry at 'slot', stable while the entry does not move */
+static inline u32 wp4_cuckoo_index(struct wp4_cuckoo *t, const u8 *slot)
+{
+    return (slot - t->entries) / t->entry_size;
+}
+
+static inline u8 wp4_cuckoo_get_tag(struct wp4_cuckoo *t, u32 bucket, u32 way)
+{
+    return t->tags[bucket] >> (8 * way);
+}
+
+static inline void wp4_cuckoo_set_tag(struct wp4_cuckoo *t, u32 bucket, u32 way, u8 tag)
+{
+    WRITE_ONCE(t->tags[bucket], (t->tags[bucket] & ~(0xffu << (8 * way))) | ((u32)tag << (8 * way)));
+}
+
+/* Compares the four tags of a bucket at once, SIMD within a register: bit 7
+ * of byte i is set if way i may hold 'tag'.  The lowest set bit is exact;
+ * higher ones can be false positives, which the key compare rejects. */
+static inline u32 wp4_cuckoo_match(u32 tags, u8 tag)
+{
+    u32 x = tags ^ (tag * 0x01010101u);
+    return (x - 0x01010101u) & ~x & 0x80808080u;
+}
+
+static inline u8 *wp4_cuckoo_find(struct wp4_cuckoo *t, const void *key, u32 key_size, u32 hash)
+{
+    u8 tag = wp4_cuckoo_tag(hash);
+    u32 bucket = hash & t->mask;
+    u32 m;
+    u8 *e;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        for (m = wp4_cuckoo_match(READ_ONCE(t->tags[bucket]), tag); m; m &= m - 1) {
+            e = wp4_cuckoo_slot(t, bucket, __ffs(m) / 8);
+            if (wp4_key_equal(e, key, key_size))
+                return e;
+        }
+        bucket = wp4_cuckoo_alt(t, bucket, tag);
+    }
+    return NULL;
+}
+
+/* Copies the value of 'key' out; key_size is a constant at the call site,
+ * so the key compare is inlined.  Returns false on a miss. */
+static inline bool wp4_cuckoo_lookup(struct wp4_cuckoo *t, const void *key, u32 key_size,
+                                     void *value, u32 value_size)
+{
+    u32 hash = jhash(key, key_size, 0);
+    unsigned int seq;
+    u8 *e;
+
+    do {
+        seq = read_seqcount_begin(&t->seq);
+        e = wp4_cuckoo_find(t, key, key_size, hash);
+        if (e)
+            memcpy(value, e + t->value_offset, value_size);
+    } while (read_seqcount_retry(&t->seq, seq));
+    return e != NULL;
+}
+
+static inline void wp4_cuckoo_swap(struct wp4_cuckoo *t, u32 bucket, u32 way, u8 *carry, u8 *tmp, u8 *tag)
+{
+    u8 *slot = wp4_cuckoo_slot(t, bucket, way);
+    u8 victim = wp4_cuckoo_get_tag(t, bucket, way);
+
+    memcpy(tmp, slot, t->entry_size);
+    memcpy(slot, carry, t->entry_size);
+    memcpy(carry, tmp, t->entry_size);
+    wp4_cuckoo_set_tag(t, bucket, way, *tag);
+    *tag = victim;
+}
+
+/* Inserts or replaces an entry.  When both buckets are full an entry is
+ * evicted to its other bucket, and so on for up to WP4_CUCKOO_MAX_KICKS
+ * moves; if that fails the moves are undone and -ENOSPC returned. */
+static inline int wp4_cuckoo_insert(struct wp4_cuckoo *t, const void *key, const void *value)
+{
+    u32 hash = jhash(key, t->key_size, 0);
+    u8 tag = wp4_cuckoo_tag(hash);
+    u32 bucket = hash & t->mask;
+    u32 kick, way, alt, b, *path;
+    u8 *carry, *tmp, *slot;
+    int err = 0;
+
+    carry = kmalloc(ALIGN(2 * t->entry_size, sizeof(u32)) + WP4_CUCKOO_MAX_KICKS * sizeof(u32),
+                    GFP_ATOMIC);
+    if (!carry)
+        return -ENOMEM;
+    tmp = carry + t->entry_size;
+    path = (u32 *)(carry + ALIGN(2 * t->entry_size, sizeof(u32)));
+    memset(carry, 0, t->entry_size);
+    memcpy(carry, key, t->key_size);
+    memcpy(carry + t->value_offset, value, t->value_size);
+    if (t->stamp_offset)
+        *(unsigned long *)(carry + t->stamp_offset) = jiffies;
+
+    spin_lock_bh(&t->lock);
+    write_seqcount_begin(&t->seq);
+    slot = wp4_cuckoo_find(t, key, t->key_size, hash);
+    if (slot) {
+        memcpy(slot + t->value_offset, carry + t->value_offset, t->value_size);
+        goto done;
+    }
+    for (kick = 0; kick < WP4_CUCKOO_MAX_KICKS; kick++) {
+        alt = wp4_cuckoo_alt(t, bucket, tag);
+        for (way = 0; way < 2 * WP4_CUCKOO_WAYS; way++) {
+            b = way < WP4_CUCKOO_WAYS ? bucket : alt;
+            if (!wp4_cuckoo_get_tag(t, b, way % WP4_CUCKOO_WAYS)) {
+                memcpy(wp4_cuckoo_slot(t, b, way % WP4_CUCKOO_WAYS), carry, t->entry_size);
+                wp4_cuckoo_set_tag(t, b, way % WP4_CUCKOO_WAYS, tag);
+                t->count++;
+                goto done;
+            }
+        }
+        /* carry on with an entry evicted from the other bucket */
+        bucket = alt;
+        way = kick % WP4_CUCKOO_WAYS;
+        wp4_cuckoo_swap(t, bucket, way, carry, tmp, &tag);
+        path[kick] = bucket * WP4_CUCKOO_WAYS + way;
+    }
+    while (kick--)
+        wp4_cuckoo_swap(t, path[kick] / WP4_CUCKOO_WAYS, path[kick] % WP4_CUCKOO_WAYS,
+                        carry, tmp, &tag);
+    err = -ENOSPC;
+done:
+    write_seqcount_end(&t->seq);
+    spin_unlock_bh(&t->lock);
+    kfree(carry);
+    return err;
+}
+
+static inline bool wp4_cuckoo_contains(struct wp4_cuckoo *t, const void *key)
+{
+    return wp4_cuckoo_find(t, key, t->key_size, jhash(key, t->key_size, 0)) != NULL;
+}
+
+/* Empties 'slot'; called with t->lock held */
+static inline void wp4_cuckoo_remove(struct wp4_cuckoo *t, u8 *slot)
+{
+    u32 index = wp4_cuckoo_index(t, slot);
+
+    write_seqcount_begin(&t->seq);
+    wp4_cuckoo_set_tag(t, index / WP4_CUCKOO_WAYS, index % WP4_CUCKOO_WAYS, 0);
+    t->count--;
+    write_seqcount_end(&t->seq);
+}
+
+static inline int wp4_cuckoo_delete(struct wp4_cuckoo *t, const void *key)
+{
+    u8 *slot;
+    int err = 0;
+
+    spin_lock_bh(&t->lock);
+    slot = wp4_cuckoo_find(t, key, t->key_size, jhash(key, t->key_size, 0));
+    if (slot)
+        wp4_cuckoo_remove(t, slot);
+    else
+        err = -ENOENT;
+    spin_unlock_bh(&t->lock);
+    return err;
+}
+
+/* The slot at 'index' if it still holds 'key', else wherever it went */
+static inline u8 *wp4_cuckoo_refind(struct wp4_cuckoo *t, const void *key, u32 key_size, u32 index)
+{
+    u8 *slot = wp4_cuckoo_slot(t, index / WP4_CUCKOO_WAYS, index % WP4_CUCKOO_WAYS);
+
+    if (wp4_cuckoo_get_tag(t, index / WP4_CUCKOO_WAYS, index % WP4_CUCKOO_WAYS) &&
+        wp4_key_equal(slot, key, key_size))
+        return slot;
+    return wp4_cuckoo_find(t, key, key_size, jhash(key, key_size, 0));
+}
+
+/* Called after a lookup of 'key' in a table whose entries age hit the
+ * entry at 'index', last stamped 'last'.  The entry is restamped at most
+ * once per tick, so a busy one does not dirty its cache line on every
+ * frame, and without the lock: if an update moved it meanwhile the
+ * seqcount says so and the stamp is written again where it went.  The one
+ * left in the old slot only delays the expiry of whatever entry is there.
+ * An entry idle for longer than the timeout is deleted under the lock,
+ * where its stamp is read again, as another CPU may have hit it since: no
+ * thread ever scans the table.  Returns false if the entry expired. */
+static inline bool wp4_cuckoo_touch(struct wp4_cuckoo *t, const void *key, u32 key_size,
+                                    u32 index, unsigned long last)
+{
+    unsigned long now = READ_ONCE(jiffies);
+    unsigned int seq;
+    bool expired;
+    u8 *slot;
+
+    if (last == now)
+        return true;
+    if (!time_after(now, last + t->timeout)) {
+        do {
+            seq = read_seqcount_begin(&t->seq);
+            slot = wp4_cuckoo_refind(t, key, key_size, index);
+            if (slot) {
+                WRITE_ONCE(*(unsigned long *)(slot + t->stamp_offset), now);
+                index = wp4_cuckoo_index(t, slot);
+            }
+        } while (read_seqcount_retry(&t->seq, seq));
+        return true;
+    }
+    spin_lock_bh(&t->lock);
+    slot = wp4_cuckoo_refind(t, key, key_size, index);
+    expired = !slot || time_after(now, READ_ONCE(*(unsigned long *)(slot + t->stamp_offset)) +
+                                       t->timeout);
+    if (slot && expired)
+        wp4_cuckoo_remove(t, slot);
+    spin_unlock_bh(&t->lock);
+    return !expired;
+}
+
+static inline void wp4_table_init(struct wp4_table *t)
+{
+    mutex_init(&t->mutex);
+    seqcount_init(&t->default_seq);
+}
+
+static inline seqcount_t *wp4_table_seq(struct wp4_table *t)
+{
+    return t->entries ? &t->entries->seq : &t->default_seq;
+}
+
+/* A write section on the entries and default action of 't'.  A lookup on
+ * this CPU must not spin on a half-written value, so bottom halves are
+ * disabled. */
+static inline void wp4_table_write_begin(struct wp4_table *t)
+{
+    if (t->entries)
+        spin_lock_bh(&t->entries->lock);
+    else
+        local_bh_disable();
+    write_seqcount_begin(wp4_table_seq(t));
+}
+
+static inline void wp4_table_write_end(struct wp4_table *t)
+{
+    write_seqcount_end(wp4_table_seq(t));
+    if (t->entries)
+        spin_unlock_bh(&t->entries->lock);
+    else
+        local_bh_enable();
+}
+
+/* Copies the default action out; 'size' is a constant at the call site */
+static inline void wp4_table_default(struct wp4_table *t, void *value, u32 size)
+{
+    seqcount_t *s = wp4_table_seq(t);
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(s);
+        memcpy(value, t->default_value, size);
+    } while (read_seqcount_retry(s, seq));
+}
+
+/* Copies the value of 'key' to 'value' on a hit, or the default action to
+ * 'def' on a miss, in one read section of a table with entries; key_size
+ * and value_size are constants at the call site.  On a hit the index of
+ * the entry goes to 'index' unless it is NULL.  Returns true on a hit. */
+static inline bool wp4_table_lookup(struct wp4_table *t, const void *key, u32 key_size,
+                                    void *value, void *def, u32 value_size, u32 *index)
+{
+    struct wp4_cuckoo *c = t->entries;
+    u32 hash = jhash(key, key_size, 0);
+    unsigned int seq;
+    u8 *e;
+
+    do {
+        seq = read_seqcount_begin(&c->seq);
+        e = wp4_cuckoo_find(c, key, key_size, hash);
+        if (e) {
+            memcpy(value, e + c->value_offset, value_size);
+            if (index)
+                *index = wp4_cuckoo_index(c, e);
+        } else {
+            memcpy(def, t->default_value, value_size);
+        }
+    } while (read_seqcount_retry(&c->seq, seq));
+    return e != NULL;
+}
+
+/* Makes 'dst' an empty table of the same geometry as 't' */
+static inline int wp4_cuckoo_init_as(struct wp4_cuckoo *dst, struct wp4_cuckoo *t)
+{
+    if (wp4_cuckoo_init(dst, (t->mask + 1) * WP4_CUCKOO_WAYS, t->key_size, t->value_offset,
+                        t->value_size, t->entry_size))
+        return -ENOMEM;
+    dst->stamp_offset = t->stamp_offset;
+    dst->timeout = t->timeout;
+    return 0;
+}
+
+/* Makes 'dst' a private copy of 't', for updates that readers must not see
+ * until it replaces them */
+static inline int wp4_cuckoo_copy(struct wp4_cuckoo *dst, struct wp4_cuckoo *t)
+{
+    u32 buckets = t->mask + 1;
+
+    if (wp4_cuckoo_init_as(dst, t))
+        return -ENOMEM;
+    memcpy(dst->tags, t->tags, buckets * sizeof(u32));
+    memcpy(dst->entries, t->entries, (size_t)buckets * WP4_CUCKOO_WAYS * t->entry_size);
+    dst->count = t->count;
+    return 0;
+}
+
+/* Swaps the entries of 't' and its copy 'c' in one seqcount write section:
+ * a lookup that saw the old arrays retries.  The old ones, now in 'c', may
+ * still be read until an RCU grace period has elapsed. */
+static inline void wp4_cuckoo_exchange(struct wp4_cuckoo *t, struct wp4_cuckoo *c)
+{
+    spin_lock_bh(&t->lock);
+    write_seqcount_begin(&t->seq);
+    swap(t->tags, c->tags);
+    swap(t->entries, c->entries);
+    swap(t->count, c->count);
+    write_seqcount_end(&t->seq);
+    spin_unlock_bh(&t->lock);
+}
+
+/* Applies an entry update record to 'c', the entries of 't' or a copy */
+static inline int wp4_table_update(struct wp4_table *t, struct wp4_cuckoo *c, const u8 *record)
+{
+    const u8 *key = record + t->key_offset;
+    const u8 *value = record + t->value_offset;
+
+    if (c == NULL)
+        return -EOPNOTSUPP;
+    switch (*(const u32 *)record) {
+    case WP4_TABLE_ADD:
+        if (wp4_cuckoo_contains(c, key))
+            return -EEXIST;
+        return wp4_cuckoo_insert(c, key, value);
+    case WP4_TABLE_MODIFY:
+        if (!wp4_cuckoo_contains(c, key))
+            return -ENOENT;
+        return wp4_cuckoo_insert(c, key, value);
+    case WP4_TABLE_DELETE:
+        return wp4_cuckoo_delete(c, key);
+    }
+    return -EINVAL;
+}
+
+/* Applies one update record; called with t->mutex held, so that the
+ * entries only change under this function */
+static inline int wp4_table_apply(struct wp4_table *t, const u8 *record)
+{
+    const u8 *value = record + t->value_offset;
+    u32 op = *(const u32 *)record;
+
+    if (t->shadow) {
+        if (op != WP4_TABLE_SET_DEFAULT)
+            return wp4_table_update(t, t->shadow, record);
+        memcpy(t->shadow_default, value, t->value_size);
+        return 0;
+    }
+    if (op == WP4_TABLE_SET_DEFAULT) {
+        wp4_table_write_begin(t);
+        memcpy(t->default_value, value, t->value_size);
+        wp4_table_write_end(t);
+        return 0;
+    }
+    return wp4_table_update(t, t->entries, record);
+}
+
+static inline int wp4_table_open(struct inode *inode, struct file *file)
+{
+    struct wp4_table_file *f = kzalloc(sizeof(*f), GFP_KERNEL);
+
+    if (!f)
+        return -ENOMEM;
+    f->table = inode->i_private;
+    file->private_data = f;
+    return 0;
+}
+
+static inline int wp4_table_release(struct inode *inode, struct file *file)
+{
+    kfree(file->private_data);
+    return 0;
+}
+
+/* debugfs write: applies the records in order and stops at the first one
+ * that fails.  The records before it stay applied; a write that applied
+ * some returns their size and keeps the error for WP4_TABLE_IOC_ERROR.
+ * The flow cache is invalidated once per write. */
+static inline ssize_t wp4_table_write(struct file *file, const char __user *buf,
+                                      size_t len, loff_t *ppos)
+{
+    struct wp4_table_file *f = file->private_data;
+    struct wp4_table *t = f->table;
+    size_t done = 0;
+    int err = 0;
+    u8 *record;
+
+    record = kmalloc(t->record_size, GFP_KERNEL);
+    if (!record)
+        return -ENOMEM;
+    mutex_lock(&t->mutex);
+    while (len - done >= t->record_size) {
+        if (copy_from_user(record, buf + done, t->record_size)) {
+            err = -EFAULT;
+            break;
+        }
+        err = wp4_table_apply(t, record);
+        if (err)
+            break;
+        done += t->record_size;
+    }
+    mutex_unlock(&t->mutex);
+    kfree(record);
+    f->err = err;
+    if (done == 0)
+        return err;
+    if (t->invalidate)
+        t->invalidate();
+    *ppos += done;
+    return done;
+}
+
+/* debugfs read: the default action as a WP4_TABLE_SET_DEFAULT record, then
+ * every entry as a WP4_TABLE_ADD record, so that a dump can be written back.
+ * The file position counts the slots visited, not bytes. */
+static inline ssize_t wp4_table_read(struct file *file, char __user *buf,
+                                     size_t len, loff_t *ppos)
+{
+    struct wp4_table *t = ((struct wp4_table_file *)file->private_data)->table;
+    struct wp4_cuckoo *c = t->entries;
+    loff_t slots = c ? (loff_t)(c->mask + 1) * WP4_CUCKOO_WAYS : 0;
+    size_t done = 0;
+    int err = 0;
+    u8 *record, *slot;
+    u32 i;
+
+    record = kzalloc(t->record_size, GFP_KERNEL);
+    if (!record)
+        return -ENOMEM;
+    mutex_lock(&t->mutex);
+    while (len - done >= t->record_size && *ppos <= slots) {
+        if (*ppos == 0) {
+            *(u32 *)record = WP4_TABLE_SET_DEFAULT;
+            memcpy(record + t->value_offset, t->default_value, t->value_size);
+        } else {
+            i = *ppos - 1;
+            if (!wp4_cuckoo_get_tag(c, i / WP4_CUCKOO_WAYS, i % WP4_CUCKOO_WAYS)) {
+                ++*ppos;
+                continue;
+            }
+            slot = wp4_cuckoo_slot(c, i / WP4_CUCKOO_WAYS, i % WP4_CUCKOO_WAYS);
+            *(u32 *)record = WP4_TABLE_ADD;
+            memcpy(record + t->key_offset, slot, c->key_size);
+            memcpy(record + t->value_offset, slot + c->value_offset, c->value_size);
+        }
+        if (copy_to_user(buf + done, record, t->record_size)) {
+            err = -EFAULT;
+            break;
+        }
+        ++*ppos;
+        done += t->record_size;
+    }
+    mutex_unlock(&t->mutex);
+    kfree(record);
+    return done ? done : err;
+}
+
+/* Makes 'c' the entries and 'def' the default action of 't' in one write
+ * section, then waits until no lookup can be reading the old entries,
+ * which are left in 'c'.  wp4_packet_in runs in softirq context, which is
+ * an RCU read-side critical section. */
+static inline void wp4_table_flip(struct wp4_table *t, struct wp4_cuckoo *c, const u8 *def)
+{
+    wp4_table_write_begin(t);
+    if (t->entries) {
+        swap(t->entries->tags, c->tags);
+        swap(t->entries->entries, c->entries);
+        swap(t->entries->count, c->count);
+    }
+    memcpy(t->default_value, def, t->value_size);
+    wp4_table_write_end(t);
+    if (t->invalidate)
+        t->invalidate();
+    if (t->entries)
+        synchronize_rcu();
+}
+
+/* Drops the shadow; called with t->mutex held, or at module exit */
+static inline void wp4_table_free(struct wp4_table *t)
+{
+    if (!t->shadow)
+        return;
+    wp4_cuckoo_free(t->shadow);
+    kfree(t->shadow);
+    kfree(t->shadow_default);
+    t->shadow = NULL;
+    t->shadow_default = NULL;
+}
+
+static inline int wp4_table_shadow(struct wp4_table *t)
+{
+    if (!t->entries)
+        return -EOPNOTSUPP;
+    /* a replacement that was not committed is started over */
+    wp4_table_free(t);
+    t->shadow = kmalloc(sizeof(*t->shadow), GFP_KERNEL);
+    t->shadow_default = kmalloc(t->value_size, GFP_KERNEL);
+    if (!t->shadow || !t->shadow_default || wp4_cuckoo_init_as(t->shadow, t->entries)) {
+        kfree(t->shadow);
+        kfree(t->shadow_default);
+        t->shadow = NULL;
+        t->shadow_default = NULL;
+        return -ENOMEM;
+    }
+    memcpy(t->shadow_default, t->default_value, t->value_size);
+    return 0;
+}
+
+static inline int wp4_table_commit(struct wp4_table *t)
+{
+    if (!t->shadow)
+        return -ENOENT;
+    wp4_table_flip(t, t->shadow, t->shadow_default);
+    wp4_table_free(t);
+    return 0;
+}
+
+/* WP4_TABLE_IOC_BATCH: the records are applied to a copy of the entries,
+ * which then replaces them with a single flip, so a batch of any size
+ * costs one grace period instead of a seqcount write section per record.
+ * During a replacement the batch goes to the shadow instead. */
+static inline long wp4_table_batch(struct wp4_table *t, struct wp4_table_batch __user *ubatch)
+{
+    struct wp4_table_batch batch;
+    struct wp4_cuckoo stage, *entries;
+    u8 *records, *record, *def;
+    u32 i = 0;
+    int err = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count == 0)
+        return 0;
+    if (batch.count > WP4_TABLE_BATCH_MAX)
+        return -E2BIG;
+    records = kvmalloc_array(batch.count, t->record_size, GFP_KERNEL);
+    def = kmalloc(t->value_size, GFP_KERNEL);
+    if (!records || !def) {
+        err = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(records, u64_to_user_ptr(batch.records),
+                       (size_t)batch.count * t->record_size)) {
+        err = -EFAULT;
+        goto out;
+    }
+
+    mutex_lock(&t->mutex);
+    entries = t->shadow ? t->shadow : t->entries;
+    if (entries && wp4_cuckoo_copy(&stage, entries)) {
+        mutex_unlock(&t->mutex);
+        err = -ENOMEM;
+        goto out;
+    }
+    memcpy(def, t->shadow ? t->shadow_default : t->default_value, t->value_size);
+    for (i = 0; i < batch.count; i++) {
+        record = records + (size_t)i * t->record_size;
+        if (*(u32 *)record == WP4_TABLE_SET_DEFAULT)
+            memcpy(def, record + t->value_offset, t->value_size);
+        else
+            err = wp4_table_update(t, entries ? &stage : NULL, record);
+        if (err)
+            break;
+    }
+    if (!err && t->shadow) {
+        wp4_cuckoo_exchange(t->shadow, &stage);
+        memcpy(t->shadow_default, def, t->value_size);
+    } else if (!err) {
+        wp4_table_flip(t, &stage, def);
+    }
+    if (entries)
+        wp4_cuckoo_free(&stage);
+    mutex_unlock(&t->mutex);
+    if (err && put_user(i, &ubatch->failed))
+        err = -EFAULT;
+out:
+    kfree(def);
+    kvfree(records);
+    return err;
+}
+
+static inline long wp4_table_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct wp4_table_file *f = file->private_data;
+    struct wp4_table *t = f->table;
+    long err;
+
+    if (cmd == WP4_TABLE_IOC_ERROR)
+        return f->err;
+    if (cmd == WP4_TABLE_IOC_BATCH)
+        return wp4_table_batch(t, (struct wp4_table_batch __user *)arg);
+    mutex_lock(&t->mutex);
+    switch (cmd) {
+    case WP4_TABLE_IOC_SHADOW:
+        err = wp4_table_shadow(t);
+        break;
+    case WP4_TABLE_IOC_COMMIT:
+        err = wp4_table_commit(t);
+        break;
+    case WP4_TABLE_IOC_ABORT:
+        wp4_table_free(t);
+        err = 0;
+        break;
+    default:
+        err = -ENOTTY;
+    }
+    mutex_unlock(&t->mutex);
+    return err;
+}
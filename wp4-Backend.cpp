@@ -22,6 +22,7 @@ limitations under the License.
 #include "wp4-Target.h"
 #include "wp4-Type.h"
 #include "wp4-Program.h"
+#include "wp4-Profile.h"
 
 namespace WP4 {
 
@@ -45,6 +46,16 @@ void run_wp4_backend(const WP4Options& options, const IR::ToplevelBlock* topleve
 
     WP4TypeFactory::createFactory(typeMap);
     auto wp4prog = new WP4Program(options, toplevel->getProgram(), refMap, typeMap, toplevel);
+    if (options.profileGenerate && !options.profileUseFile.isNullOrEmpty()) {
+        ::error("--profile-gen and --profile-use cannot be combined");
+        return;
+    }
+    wp4prog->profile->instrument = options.profileGenerate;
+    wp4prog->flowCacheSize = options.flowCacheSize;
+    wp4prog->radiotap = options.radiotap;
+    wp4prog->egressScheduler = options.egressScheduler;
+    if (!options.profileUseFile.isNullOrEmpty() && !wp4prog->profile->load(options.profileUseFile))
+        return;
     if (!wp4prog->build())
         return;
 
@@ -65,17 +76,25 @@ void run_wp4_backend(const WP4Options& options, const IR::ToplevelBlock* topleve
     auto hstream = openFile(hfile, false);
     if (hstream == nullptr)
         return;
+    cstring ctlfile = hfile.before(hfile.findlast('.')) + "_ctl.h";
+    auto ctlstream = openFile(ctlfile, false);
+    if (ctlstream == nullptr)
+        return;
     
     CodeBuilder c(target);
     CodeBuilder h(target);
+    CodeBuilder ctl(target);
 
     wp4prog->emitH(&h, hfile);
     wp4prog->emitC(&c, hfile);
+    wp4prog->emitControlPlane(&ctl);
     
     *cstream << c.toString();
     *hstream << h.toString();
+    *ctlstream << ctl.toString();
     cstream->flush();
     hstream->flush();
+    ctlstream->flush();
 }
 
 }  // namespace WP4
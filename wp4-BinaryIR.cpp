@@ -0,0 +1,351 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "wp4-BinaryIR.h"
+#include "ir/json_generator.h"
+#include "ir/json_loader.h"
+#include "ir/json_parser.h"
+#include "lib/error.h"
+#include "lib/nullstream.h"
+
+namespace WP4 {
+
+namespace {
+
+const char magic[4] = { 'W', 'P', '4', 'B' };
+
+enum Tag : uint8_t {
+    TagNull = 0,
+    TagFalse,
+    TagTrue,
+    TagInt,
+    TagBigInt,
+    TagString,
+    TagVector,
+    TagObject,
+};
+
+class BinaryIRWriter {
+    std::unordered_map<std::string, unsigned> stringIndex;
+    std::vector<const std::string*> strings;
+    std::string out;
+
+    unsigned intern(const std::string& s) {
+        auto it = stringIndex.find(s);
+        if (it != stringIndex.end())
+            return it->second;
+        unsigned index = strings.size();
+        auto ins = stringIndex.emplace(s, index);
+        strings.push_back(&ins.first->first);
+        return index;
+    }
+
+    static bool fitsInt64(const big_int& value) {
+        return value >= std::numeric_limits<int64_t>::min() &&
+               value <= std::numeric_limits<int64_t>::max();
+    }
+
+    static std::string bigIntString(const big_int& value) {
+        std::ostringstream os;
+        os << value;
+        return os.str();
+    }
+
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    // First pass: build the string table so that the tree can refer to it.
+    void collect(JsonData* json) {
+        if (auto num = dynamic_cast<JsonNumber*>(json)) {
+            if (!fitsInt64(num->val))
+                intern(bigIntString(num->val));
+        } else if (auto str = dynamic_cast<JsonString*>(json)) {
+            intern(*str);
+        } else if (auto vec = dynamic_cast<JsonVector*>(json)) {
+            for (auto e : *vec)
+                collect(e);
+        } else if (auto obj = dynamic_cast<JsonObject*>(json)) {
+            for (auto& m : *obj) {
+                intern(m.first);
+                collect(m.second);
+            }
+        }
+    }
+
+    void putValue(JsonData* json) {
+        if (json == nullptr || dynamic_cast<JsonNull*>(json) != nullptr) {
+            out.push_back(TagNull);
+        } else if (auto b = dynamic_cast<JsonBoolean*>(json)) {
+            out.push_back(b->val ? TagTrue : TagFalse);
+        } else if (auto num = dynamic_cast<JsonNumber*>(json)) {
+            if (fitsInt64(num->val)) {
+                int64_t v = num->val.convert_to<int64_t>();
+                out.push_back(TagInt);
+                // zig-zag encoding keeps small negative numbers short
+                putVarint((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+            } else {
+                out.push_back(TagBigInt);
+                putVarint(stringIndex.at(bigIntString(num->val)));
+            }
+        } else if (auto str = dynamic_cast<JsonString*>(json)) {
+            out.push_back(TagString);
+            putVarint(stringIndex.at(*str));
+        } else if (auto vec = dynamic_cast<JsonVector*>(json)) {
+            out.push_back(TagVector);
+            putVarint(vec->size());
+            for (auto e : *vec)
+                putValue(e);
+        } else if (auto obj = dynamic_cast<JsonObject*>(json)) {
+            out.push_back(TagObject);
+            putVarint(obj->size());
+            for (auto& m : *obj) {
+                putVarint(stringIndex.at(m.first));
+                putValue(m.second);
+            }
+        } else {
+            BUG("Unexpected json value");
+        }
+    }
+
+ public:
+    std::string encode(JsonData* root) {
+        collect(root);
+        out.append(magic, sizeof(magic));
+        for (unsigned i = 0; i < 4; i++)
+            out.push_back(static_cast<char>((BinaryIR::version >> (8 * i)) & 0xff));
+        putVarint(strings.size());
+        for (auto s : strings) {
+            putVarint(s->size());
+            out.append(*s);
+        }
+        putValue(root);
+        return out;
+    }
+};
+
+class BinaryIRReader {
+    const uint8_t* pos = nullptr;
+    const uint8_t* end = nullptr;
+    bool ok = true;
+    std::vector<std::string> strings;
+    // String values are immutable once loaded, so every occurrence of the
+    // same string shares a single JsonString.
+    std::vector<JsonString*> values;
+
+    uint64_t getVarint() {
+        uint64_t result = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (pos == end) {
+                ok = false;
+                return 0;
+            }
+            uint8_t byte = *pos++;
+            result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return result;
+        }
+        ok = false;
+        return 0;
+    }
+
+    const std::string* getString() {
+        uint64_t index = getVarint();
+        if (!ok || index >= strings.size()) {
+            ok = false;
+            return nullptr;
+        }
+        return &strings[index];
+    }
+
+    JsonData* getStringValue() {
+        uint64_t index = getVarint();
+        if (!ok || index >= strings.size()) {
+            ok = false;
+            return nullptr;
+        }
+        if (values[index] == nullptr)
+            values[index] = new JsonString(strings[index]);
+        return values[index];
+    }
+
+    JsonData* getValue() {
+        if (pos == end) {
+            ok = false;
+            return nullptr;
+        }
+        switch (*pos++) {
+            case TagNull:
+                return new JsonNull();
+            case TagFalse:
+                return new JsonBoolean(false);
+            case TagTrue:
+                return new JsonBoolean(true);
+            case TagInt: {
+                uint64_t zz = getVarint();
+                int64_t v = static_cast<int64_t>(zz >> 1) ^ -static_cast<int64_t>(zz & 1);
+                return new JsonNumber(big_int(v));
+            }
+            case TagBigInt: {
+                auto s = getString();
+                if (s == nullptr)
+                    return nullptr;
+                return new JsonNumber(big_int(s->c_str()));
+            }
+            case TagString:
+                return getStringValue();
+            case TagVector: {
+                uint64_t count = getVarint();
+                if (!ok || count > static_cast<uint64_t>(end - pos)) {
+                    ok = false;
+                    return nullptr;
+                }
+                auto vec = new JsonVector();
+                vec->reserve(count);
+                for (uint64_t i = 0; ok && i < count; i++)
+                    vec->push_back(getValue());
+                return vec;
+            }
+            case TagObject: {
+                uint64_t count = getVarint();
+                if (!ok || count > static_cast<uint64_t>(end - pos)) {
+                    ok = false;
+                    return nullptr;
+                }
+                ordered_map<std::string, JsonData*> members;
+                for (uint64_t i = 0; ok && i < count; i++) {
+                    auto key = getString();
+                    if (key == nullptr)
+                        return nullptr;
+                    members[*key] = getValue();
+                }
+                return new JsonObject(members);
+            }
+            default:
+                ok = false;
+                return nullptr;
+        }
+    }
+
+ public:
+    JsonData* decode(const uint8_t* data, size_t size) {
+        pos = data;
+        end = data + size;
+        if (size < sizeof(magic) + 4 || memcmp(data, magic, sizeof(magic)) != 0)
+            return nullptr;
+        pos += sizeof(magic);
+        unsigned fileVersion = 0;
+        for (unsigned i = 0; i < 4; i++)
+            fileVersion |= static_cast<unsigned>(*pos++) << (8 * i);
+        if (fileVersion != BinaryIR::version)
+            return nullptr;
+
+        uint64_t count = getVarint();
+        if (!ok || count > static_cast<uint64_t>(end - pos))
+            return nullptr;
+        strings.reserve(count);
+        values.assign(count, nullptr);
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t len = getVarint();
+            if (!ok || len > static_cast<uint64_t>(end - pos))
+                return nullptr;
+            strings.emplace_back(reinterpret_cast<const char*>(pos), len);
+            pos += len;
+        }
+
+        auto root = getValue();
+        if (!ok || pos != end)
+            return nullptr;
+        return root;
+    }
+};
+
+}  // namespace
+
+bool BinaryIR::save(const IR::Node* node, cstring file) {
+    CHECK_NULL(node);
+    // Reuse the generated toJSON methods to walk the node set; the text is
+    // only an intermediate representation on the (rare) write path.
+    std::stringstream text;
+    JSONGenerator(text) << node;
+    JsonData* json = nullptr;
+    text >> json;
+    if (json == nullptr) {
+        ::error("%s: could not serialize program", file);
+        return false;
+    }
+
+    BinaryIRWriter writer;
+    auto data = writer.encode(json);
+    auto stream = openFile(file, true);
+    if (stream == nullptr)
+        return false;
+    stream->write(data.data(), data.size());
+    stream->flush();
+    return true;
+}
+
+const IR::P4Program* BinaryIR::load(cstring file) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        ::error("%s: No such file or directory.", file);
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        ::error("%s: Not valid input file", file);
+        close(fd);
+        return nullptr;
+    }
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ::error("%s: could not map file", file);
+        return nullptr;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    BinaryIRReader reader;
+    auto json = reader.decode(static_cast<const uint8_t*>(map), size);
+    munmap(map, size);
+    if (json == nullptr) {
+        ::error("%s: Not valid binary IR file", file);
+        return nullptr;
+    }
+
+    std::unordered_map<int, IR::Node*> refs;
+    JSONLoader loader(json, refs);
+    return new IR::P4Program(loader);
+}
+
+}  // namespace WP4
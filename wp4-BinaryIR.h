@@ -0,0 +1,56 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_WP4_BINARYIR_H_
+#define _BACKENDS_WP4_BINARYIR_H_
+
+#include "ir/ir.h"
+#include "lib/cstring.h"
+
+namespace WP4 {
+
+/**
+  Compact binary IR snapshots.
+
+  A snapshot carries the same node tree that JSONGenerator produces, but
+  every string is stored once in a length-prefixed table and the tree
+  refers to it by index, so loading needs no text parsing at all.
+  The file is mapped with mmap and decoded in a single pass directly into
+  the structure that JSONLoader consumes, which reuses the generated IR
+  constructors for the node set.
+
+  Layout (all integers are LEB128 varints unless noted):
+    "WP4B" magic, u32 version (little endian)
+    string count, then for every string: length, bytes
+    root value
+  A value is a tag byte followed by its payload:
+    null, false, true, int (zig-zag), bignum (string index),
+    string (string index), vector (count, values),
+    object (count, then key string index and value per member).
+*/
+class BinaryIR {
+ public:
+    static const unsigned version = 1;
+
+    // Writes 'node' to 'file'; returns false and reports an error on failure.
+    static bool save(const IR::Node* node, cstring file);
+    // Returns nullptr and reports an error on failure.
+    static const IR::P4Program* load(cstring file);
+};
+
+}  // namespace WP4
+
+#endif  /* _BACKENDS_WP4_BINARYIR_H_ */
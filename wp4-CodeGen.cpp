@@ -27,8 +27,23 @@ void CodeGenInspector::substitute(const IR::Parameter* p, const IR::Parameter* w
 { substitution.emplace(p, with); }
 
 bool CodeGenInspector::preorder(const IR::Constant* expression) {
-    builder->append(expression->toString());
-    return true;
+    unsigned width = wideWidth(expression);
+    if (width == 0) {
+        builder->append(expression->toString());
+        return true;
+    }
+    // a compound literal, least significant byte first
+    big_int value = expression->value;
+    if (value < 0)
+        value += Util::shift_left(1, width);
+    builder->append("((const u8[]){ ");
+    for (unsigned i = 0; i < ROUNDUP(width, 8); i++) {
+        if (i != 0)
+            builder->append(", ");
+        builder->appendFormat("0x%02x", static_cast<unsigned>((value >> (8 * i)) & 0xff));
+    }
+    builder->append(" })");
+    return false;
 }
 
 bool CodeGenInspector::preorder(const IR::StringLiteral* expression) {
@@ -39,9 +54,16 @@ bool CodeGenInspector::preorder(const IR::StringLiteral* expression) {
 bool CodeGenInspector::preorder(const IR::Declaration_Variable* decl) {
     auto type = WP4TypeFactory::instance->create(decl->type);
     type->declare(builder, decl->name.name, false);
+    unsigned width = decl->initializer == nullptr ? 0 : wideWidth(decl->initializer);
+    if (width != 0) {
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        emitWideAssignment(decl->name.name, decl->initializer, width);
+        return false;
+    }
     if (decl->initializer != nullptr) {
         builder->append(" = ");
-        visit(decl->initializer);
+        emitMasked(decl->initializer);
     }
     builder->endOfStatement();
     return false;
@@ -49,12 +71,20 @@ bool CodeGenInspector::preorder(const IR::Declaration_Variable* decl) {
 
 bool CodeGenInspector::preorder(const IR::Operation_Binary* b) {
     widthCheck(b);
+    // these read the bits above the width of their operands
+    bool exact = b->is<IR::Shr>() || b->is<IR::Div>() || b->is<IR::Mod>();
     builder->append("(");
-    visit(b->left);
+    if (exact)
+        emitMasked(b->left);
+    else
+        visit(b->left);
     builder->spc();
     builder->append(b->getStringOp());
     builder->spc();
-    visit(b->right);
+    if (exact || b->is<IR::Shl>())
+        emitMasked(b->right);
+    else
+        visit(b->right);
     builder->append(")");
     return false;
 }
@@ -63,22 +93,40 @@ bool CodeGenInspector::comparison(const IR::Operation_Relation* b) {
     auto type = typeMap->getType(b->left);
     auto et = WP4TypeFactory::instance->create(type);
 
+    unsigned width = wideWidth(b->left);
+    if (width != 0) {
+        cstring left = wideValue(b->left, width);
+        cstring right = wideValue(b->right, width);
+        if (b->is<IR::Equ>() || b->is<IR::Neq>()) {
+            builder->appendFormat("%swp4_key_equal(%s, %s, %d)", b->is<IR::Neq>() ? "!" : "",
+                                  left.c_str(), right.c_str(), ROUNDUP(width, 8));
+        } else {
+            if (type->is<IR::Type_Bits>() && type->to<IR::Type_Bits>()->isSigned)
+                ::error("%1%: signed comparisons on %2% bits not supported", b, width);
+            builder->appendFormat("(wp4_wide_cmp(%s, %s, %d) %s 0)", left.c_str(), right.c_str(),
+                                  width, b->getStringOp());
+        }
+        return false;
+    }
+
     bool scalar = (et->is<WP4ScalarType>() &&
                    WP4ScalarType::generatesScalar(et->to<WP4ScalarType>()->widthInBits()))
                   || et->is<WP4BoolType>();
     if (scalar) {
         builder->append("(");
-        visit(b->left);
+        emitMasked(b->left);
         builder->spc();
         builder->append(b->getStringOp());
         builder->spc();
-        visit(b->right);
+        emitMasked(b->right);
         builder->append(")");
     } else {
         if (!et->is<IHasWidth>())
             BUG("%1%: Comparisons for type %2% not yet implemented", type);
         unsigned width = et->to<IHasWidth>()->implementationWidthInBits();
-        builder->append("memcmp(&");
+        if (b->is<IR::Neq>())
+            builder->append("!");
+        builder->append("wp4_key_equal(&");
         visit(b->left);
         builder->append(", &");
         visit(b->right);
@@ -120,17 +168,43 @@ bool CodeGenInspector::preorder(const IR::ArrayIndex* a) {
 
 bool CodeGenInspector::preorder(const IR::Cast* c) {
     widthCheck(c);
+    unsigned width = wideWidth(c->expr);
+    if (width != 0) {
+        // a slice of a wide value, (bit<n>)(v >> offset) after lowering
+        auto source = c->expr;
+        unsigned offset = 0;
+        auto shr = source->to<IR::Shr>();
+        if (shr != nullptr && shr->right->is<IR::Constant>()) {
+            source = shr->left;
+            offset = shr->right->to<IR::Constant>()->asUnsigned();
+        }
+        unsigned destWidth = typeMap->getType(c, true)->width_bits();
+        builder->append("((");
+        WP4TypeFactory::instance->create(c->destType)->emit(builder);
+        builder->appendFormat(")wp4_wide_bits(%s, %d, %d)", wideValue(source, width).c_str(),
+                              width, offset);
+        if (destWidth < 64)
+            builder->appendFormat(" & WP4_MASK(u64, %d)", destWidth);
+        builder->append(")");
+        return false;
+    }
     builder->append("(");
     builder->append("(");
     auto et = WP4TypeFactory::instance->create(c->destType);
     et->emit(builder);
     builder->append(")");
-    visit(c->expr);
+    auto source = typeMap->getType(c->expr, true)->to<IR::Type_Bits>();
+    if (source != nullptr && source->size < typeMap->getType(c, true)->width_bits())
+        emitMasked(c->expr);
+    else
+        visit(c->expr);
     builder->append(")");
     return false;
 }
 
 bool CodeGenInspector::preorder(const IR::Member* expression) {
+    if (stackMember(expression))
+        return false;
     auto ei = P4::EnumInstance::resolve(expression, typeMap);
     if (ei == nullptr) {
         visit(expression->expr);
@@ -140,6 +214,46 @@ bool CodeGenInspector::preorder(const IR::Member* expression) {
     return false;
 }
 
+bool CodeGenInspector::stackMember(const IR::Member* expression) {
+    auto type = typeMap->getType(expression->expr);
+    auto st = type == nullptr ? nullptr : type->to<IR::Type_Stack>();
+    if (st == nullptr)
+        return false;
+    cstring member = expression->member.name;
+    if (member == IR::Type_Stack::arraySize) {
+        builder->append(Util::toString(st->getSize()));
+        return true;
+    }
+    // the index lives next to the stack in the enclosing struct
+    auto stack = expression->expr->to<IR::Member>();
+    if (stack == nullptr) {
+        ::error("%1%: only header stacks within structs are supported", expression);
+        return true;
+    }
+    auto next = new IR::Member(stack->expr, WP4StackType::nextIndex(stack->member.name));
+    if (member == IR::Type_Stack::next) {
+        visit(stack);
+        builder->append("[");
+        visit(next);
+        builder->append("]");
+    } else if (member == IR::Type_Stack::last) {
+        // the first element while the stack is empty
+        visit(stack);
+        builder->append("[");
+        visit(next);
+        builder->append(" ? ");
+        visit(next);
+        builder->append(" - 1 : 0]");
+    } else if (member == IR::Type_Stack::lastIndex) {
+        builder->append("((u32)");
+        visit(next);
+        builder->append(" - 1)");
+    } else {
+        ::error("%1%: not supported", expression);
+    }
+    return true;
+}
+
 bool CodeGenInspector::preorder(const IR::PathExpression* expression) {
     visit(expression->path);
     return false;
@@ -178,8 +292,12 @@ bool CodeGenInspector::preorder(const IR::MethodCallExpression* expression) {
             builder->append(".wp4_valid");
             return false;
         } else if (bim->name == IR::Type_Header::setValid) {
+            // a header made valid is never in place in the output packet,
+            // whatever header was extracted at its offset
+            visit(bim->appliedTo);
+            builder->append(".wp4_valid = true, ");
             visit(bim->appliedTo);
-            builder->append(".wp4_valid = true");
+            builder->append(".wp4_offset = 0xffff");
             return false;
         } else if (bim->name == IR::Type_Header::setInvalid) {
             visit(bim->appliedTo);
@@ -200,7 +318,7 @@ bool CodeGenInspector::preorder(const IR::MethodCallExpression* expression) {
             p->direction == IR::Direction::InOut)
             builder->append("&");
         auto arg = mi->substitution.lookup(p);
-        visit(arg);
+        emitMasked(arg->expression);
     }
     builder->append(")");
     return false;
@@ -233,6 +351,12 @@ bool CodeGenInspector::preorder(const IR::Type_Enum* type) {
 }
 
 bool CodeGenInspector::preorder(const IR::AssignmentStatement* a) {
+    unsigned wide = wideWidth(a->left);
+    if (wide != 0 && !a->right->is<IR::PathExpression>() && !a->right->is<IR::Member>() &&
+        !a->right->is<IR::ArrayIndex>()) {
+        emitWideAssignment(render(a->left), a->right, wide);
+        return false;
+    }
     auto ltype = typeMap->getType(a->left);
     auto wp4Type = WP4TypeFactory::instance->create(ltype);
     bool memcpy = false;
@@ -253,7 +377,11 @@ bool CodeGenInspector::preorder(const IR::AssignmentStatement* a) {
     } else {
         visit(a->left);
         builder->append(" = ");
-        visit(a->right);
+        // storing into a machine word of the same width truncates
+        if (scalar != nullptr && scalar->widthInBits() == width)
+            visit(a->right);
+        else
+            emitMasked(a->right);
     }
     builder->endOfStatement();
     return false;
@@ -337,14 +465,208 @@ void CodeGenInspector::widthCheck(const IR::Node* node) const {
     auto type = typeMap->getType(node, true);
     auto tb = type->to<IR::Type_Bits>();
     if (tb == nullptr) return;
-    if (tb->size % 8 == 0 && WP4ScalarType::generatesScalar(tb->size))
+    if (WP4ScalarType::generatesScalar(tb->size))
+        return;
+
+    // Wide values are computed by statements, see emitWide
+    ::error("%1%: Computations on %2% bits are only supported when assigned to a variable",
+            node, tb->size);
+}
+
+bool CodeGenInspector::mayOverflow(const IR::Expression* expression) const {
+    auto type = typeMap->getType(expression);
+    if (type == nullptr)  // constants made by LowerExpressions
+        type = expression->type;
+    if (auto tn = type->to<IR::Type_Name>())
+        type = typeMap->getTypeType(tn, true);
+    auto tb = type->to<IR::Type_Bits>();
+    if (tb == nullptr || !WP4ScalarType::generatesScalar(tb->size))
+        return false;
+
+    if (expression->is<IR::Add>() || expression->is<IR::Sub>() || expression->is<IR::Mul>() ||
+        expression->is<IR::Shl>() || expression->is<IR::Cmpl>() || expression->is<IR::Neg>())
+        // u8 and u16 are promoted to int; u32 and u64 wrap on their own
+        return tb->size != 32 && tb->size != 64;
+    if (auto b = expression->to<IR::BAnd>())
+        return mayOverflow(b->left) && mayOverflow(b->right);
+    if (expression->is<IR::BOr>() || expression->is<IR::BXor>()) {
+        auto b = expression->to<IR::Operation_Binary>();
+        return mayOverflow(b->left) || mayOverflow(b->right);
+    }
+    if (auto m = expression->to<IR::Mux>())
+        return mayOverflow(m->e1) || mayOverflow(m->e2);
+    if (auto c = expression->to<IR::Cast>()) {
+        if (tb->size == 8 || tb->size == 16 || tb->size == 32 || tb->size == 64)
+            return false;  // the C cast truncates
+        auto source = typeMap->getType(c->expr, true)->to<IR::Type_Bits>();
+        return source == nullptr || source->size > tb->size || mayOverflow(c->expr);
+    }
+    return false;
+}
+
+void CodeGenInspector::emitMasked(const IR::Expression* expression) {
+    if (!mayOverflow(expression)) {
+        visit(expression);
+        return;
+    }
+    auto type = typeMap->getType(expression);
+    if (type == nullptr)
+        type = expression->type;
+    if (auto tn = type->to<IR::Type_Name>())
+        type = typeMap->getTypeType(tn, true);
+    auto et = WP4TypeFactory::instance->create(type);
+    unsigned width = et->to<IHasWidth>()->widthInBits();
+    builder->append("(");
+    if (type->to<IR::Type_Bits>() != nullptr && type->to<IR::Type_Bits>()->isSigned) {
+        // sign-extend from the top bit of the width
+        builder->append("(");
+        et->emit(builder);
+        builder->append(")((s64)((u64)(");
+        visit(expression);
+        builder->appendFormat(") << %d) >> %d)", 64 - width, 64 - width);
+    } else {
+        visit(expression);
+        builder->append(" & WP4_MASK(");
+        et->emit(builder);
+        builder->appendFormat(", %d)", width);
+    }
+    builder->append(")");
+}
+
+/////////////////////////////////////////
+
+unsigned CodeGenInspector::wideWidth(const IR::Expression* expression) const {
+    auto type = typeMap->getType(expression);
+    if (type == nullptr)  // constants made by LowerExpressions
+        type = expression->type;
+    if (auto tn = type->to<IR::Type_Name>())
+        type = typeMap->getTypeType(tn, true);
+    auto tb = type->to<IR::Type_Bits>();
+    if (tb == nullptr || WP4ScalarType::generatesScalar(tb->size))
+        return 0;
+    return tb->size;
+}
+
+cstring CodeGenInspector::render(const IR::Expression* expression) {
+    auto outer = builder;
+    CodeBuilder inner(builder->target);
+    builder = &inner;
+    visit(expression);
+    builder = outer;
+    return inner.toString();
+}
+
+// A wide value that needs no statements to compute: a variable, a field
+// or a constant.
+cstring CodeGenInspector::wideValue(const IR::Expression* expression, unsigned width) {
+    if ((expression->is<IR::PathExpression>() || expression->is<IR::Member>() ||
+         expression->is<IR::ArrayIndex>() || expression->is<IR::Constant>()) &&
+        wideWidth(expression) == width)
+        return render(expression);
+    ::error("%1%: assign this %2%-bit value to a variable first", expression, width);
+    return "NULL";
+}
+
+// Returns an array holding 'expression' at 'width' bits, computing it
+// into a new temporary if needed.
+cstring CodeGenInspector::wideOperand(const IR::Expression* expression, unsigned width) {
+    if ((expression->is<IR::PathExpression>() || expression->is<IR::Member>() ||
+         expression->is<IR::ArrayIndex>() || expression->is<IR::Constant>()) &&
+        wideWidth(expression) == width)
+        return render(expression);
+    cstring temp = WP4Model::reserved("wide") + Util::toString(wideTemporaries++);
+    builder->emitIndent();
+    builder->appendFormat("u8 %s[%d];", temp.c_str(), ROUNDUP(width, 8));
+    builder->newline();
+    emitWide(temp, expression, width);
+    return temp;
+}
+
+// Emits statements computing 'expression' into the array 'destination'
+void CodeGenInspector::emitWide(cstring destination, const IR::Expression* expression,
+                                unsigned width) {
+    static const std::map<cstring, cstring> binary = {
+        { "+", "add" }, { "-", "sub" }, { "&", "and" }, { "|", "or" }, { "^", "xor" } };
+
+    if (wideWidth(expression) == 0) {
+        // a machine scalar, zero-extended
+        cstring value = render(expression);
+        builder->emitIndent();
+        builder->appendFormat("wp4_wide_from_u64(%s, (u64)(%s), %d);", destination.c_str(),
+                              value.c_str(), width);
+        builder->newline();
+        return;
+    }
+
+    cstring call;
+    if (auto c = expression->to<IR::Cast>()) {
+        unsigned sourceWidth = wideWidth(c->expr);
+        if (sourceWidth == 0) {
+            emitWide(destination, c->expr, width);
+            return;
+        }
+        cstring source = wideOperand(c->expr, sourceWidth);
+        call = "wp4_wide_resize(" + destination + ", " + Util::toString(width) + ", " +
+                source + ", " + Util::toString(sourceWidth) + ")";
+    } else if (auto b = expression->to<IR::Operation_Binary>()) {
+        cstring left = wideOperand(b->left, width);
+        if (b->is<IR::Shl>() || b->is<IR::Shr>()) {
+            if (!b->right->is<IR::Constant>()) {
+                ::error("%1%: shifts on %2% bits must be by a constant", b, width);
+                return;
+            }
+            auto tb = typeMap->getType(b, true)->to<IR::Type_Bits>();
+            if (b->is<IR::Shr>() && tb != nullptr && tb->isSigned)
+                ::error("%1%: signed shifts on %2% bits not supported", b, width);
+            call = cstring("wp4_wide_") + (b->is<IR::Shl>() ? "shl" : "shr") + "(" +
+                    destination + ", " + left + ", " +
+                    Util::toString(b->right->to<IR::Constant>()->asUnsigned()) + ", " +
+                    Util::toString(width) + ")";
+        } else {
+            auto op = binary.find(b->getStringOp());
+            if (op == binary.end()) {
+                ::error("%1%: not supported on %2% bits", b, width);
+                return;
+            }
+            cstring right = wideOperand(b->right, width);
+            call = "wp4_wide_" + op->second + "(" + destination + ", " + left + ", " + right +
+                    ", " + Util::toString(width) + ")";
+        }
+    } else if (expression->is<IR::Cmpl>() || expression->is<IR::Neg>()) {
+        auto u = expression->to<IR::Operation_Unary>();
+        cstring operand = wideOperand(u->expr, width);
+        call = cstring("wp4_wide_") + (u->is<IR::Cmpl>() ? "not" : "neg") + "(" +
+                destination + ", " + operand + ", " + Util::toString(width) + ")";
+    } else if (auto m = expression->to<IR::Mux>()) {
+        cstring condition = render(m->e0);
+        builder->emitIndent();
+        builder->appendFormat("if (%s) ", condition.c_str());
+        builder->blockStart();
+        emitWide(destination, m->e1, width);
+        builder->blockEnd(false);
+        builder->append(" else ");
+        builder->blockStart();
+        emitWide(destination, m->e2, width);
+        builder->blockEnd(true);
         return;
+    } else {
+        cstring source = wideValue(expression, width);
+        if (source == destination)
+            return;
+        call = "memcpy(" + destination + ", " + source + ", " +
+                Util::toString(ROUNDUP(width, 8)) + ")";
+    }
+    builder->emitIndent();
+    builder->append(call);
+    builder->endOfStatement(true);
+}
 
-    if (tb->size <= 64)
-        // This is a bug which we can probably fix
-        BUG("%1%: Computations on %2% bits not yet supported", node, tb->size);
-    // We could argue that this may not be supported ever
-    ::error("%1%: Computations on %2% bits not supported", node, tb->size);
+void CodeGenInspector::emitWideAssignment(cstring destination, const IR::Expression* right,
+                                          unsigned width) {
+    // the temporaries are scoped to the statement
+    builder->blockStart();
+    emitWide(destination, right, width);
+    builder->blockEnd(false);
 }
 
 }  // namespace WP4
@@ -44,10 +44,20 @@ class CodeGenInspector : public Inspector {
     P4::ReferenceMap* refMap;
     P4::TypeMap* typeMap;
     std::map<const IR::Parameter*, const IR::Parameter*> substitution;
+    unsigned wideTemporaries;
+
+    // Values wider than 64 bits are u8 arrays; computations on them are
+    // lowered to calls of the runtime's wp4_wide_* helpers on temporaries.
+    unsigned wideWidth(const IR::Expression* expression) const;  // 0 if not wide
+    cstring render(const IR::Expression* expression);
+    cstring wideValue(const IR::Expression* expression, unsigned width);
+    cstring wideOperand(const IR::Expression* expression, unsigned width);
+    void emitWide(cstring destination, const IR::Expression* expression, unsigned width);
+    void emitWideAssignment(cstring destination, const IR::Expression* right, unsigned width);
 
  public:
     CodeGenInspector(P4::ReferenceMap* refMap, P4::TypeMap* typeMap) :
-            builder(nullptr), refMap(refMap), typeMap(typeMap) {
+            builder(nullptr), refMap(refMap), typeMap(typeMap), wideTemporaries(0) {
         CHECK_NULL(refMap); CHECK_NULL(typeMap);
         visitDagOnce = false;
     }
@@ -86,10 +96,16 @@ class CodeGenInspector : public Inspector {
     bool preorder(const IR::ArrayIndex* a) override;
     bool preorder(const IR::Mux* a) override;
     bool preorder(const IR::Member* e) override;
+    // next, last, lastIndex and size of a header stack; false for other members
+    bool stackMember(const IR::Member* expression);
     bool preorder(const IR::MethodCallExpression* expression) override;
     bool comparison(const IR::Operation_Relation* comp);
     bool preorder(const IR::Equ* e) override { return comparison(e); }
     bool preorder(const IR::Neq* e) override { return comparison(e); }
+    bool preorder(const IR::Lss* e) override { return comparison(e); }
+    bool preorder(const IR::Leq* e) override { return comparison(e); }
+    bool preorder(const IR::Grt* e) override { return comparison(e); }
+    bool preorder(const IR::Geq* e) override { return comparison(e); }
     bool preorder(const IR::Path* path) override;
 
     bool preorder(const IR::Type_Typedef* type) override;
@@ -103,6 +119,11 @@ class CodeGenInspector : public Inspector {
     bool preorder(const IR::IfStatement* s) override;
 
     void widthCheck(const IR::Node* node) const;
+    // Values of at most 64 bits are kept within their width in storage, but
+    // C computes in int, u32 or u64; bits above the width are only cleared
+    // where they can be observed.
+    bool mayOverflow(const IR::Expression* expression) const;
+    void emitMasked(const IR::Expression* expression);
 };
 
 }  // namespace WP4
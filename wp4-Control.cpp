@@ -14,9 +14,14 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <algorithm>
+#include <cstdio>
+
 #include "wp4-Control.h"
 #include "wp4-Type.h"
+#include "wp4-DeadFields.h"
 #include "wp4-Table.h"
+#include "wp4-FlowCache.h"
 #include "lib/error.h"
 #include "frontends/p4/tableApply.h"
 #include "frontends/p4/typeMap.h"
@@ -47,9 +52,43 @@ bool ControlBodyTranslator::preorder(const IR::PathExpression* expression) {
 }
 
 void ControlBodyTranslator::processFunction(const P4::ExternFunction* function) {
+    auto& model = control->program->model;
+    cstring name = function->method->name.name;
+    if (name == model.csum16_update.name) {
+        compileCsumUpdate(function);
+        return;
+    }
+    if (name == model.fcs_update.name) {
+        // the FCS covers the deparsed frame, so it is computed after the deparser
+        builder->emitIndent();
+        builder->appendFormat("%s = 1", control->program->fcsUpdateVar.c_str());
+        return;
+    }
     ::error("%1%: Not supported", function->method);
 }
 
+void ControlBodyTranslator::compileCsumUpdate(const P4::ExternFunction* function) {
+    auto args = function->expr->arguments;
+    BUG_CHECK(args->size() == 3, "%1%: expected 3 arguments", function->expr);
+    auto csum = args->at(0)->expression;
+    auto oldValue = args->at(1)->expression;
+    auto type = control->program->typeMap->getType(oldValue, true);
+    auto bits = type->to<IR::Type_Bits>();
+    if (bits == nullptr || bits->size > 64) {
+        ::error("%1%: checksum update supports bit<N> values of at most 64 bits", oldValue);
+        return;
+    }
+    builder->emitIndent();
+    visit(csum);
+    builder->append(" = wp4_csum16_update(");
+    visit(csum);
+    builder->append(", (u64)(");
+    emitMasked(oldValue);
+    builder->append("), (u64)(");
+    emitMasked(args->at(2)->expression);
+    builder->appendFormat("), %d)", (bits->size + 15) / 16);
+}
+
 bool ControlBodyTranslator::preorder(const IR::MethodCallExpression* expression) {
     builder->append("/* ");
     visit(expression->method);
@@ -78,6 +117,29 @@ bool ControlBodyTranslator::preorder(const IR::MethodCallExpression* expression)
         processFunction(ef);
         return false;
     }
+    auto em = mi->to<P4::ExternMethod>();
+    if (em != nullptr && em->originalExternType->name.name == p4lib.packetOut.name &&
+        em->method->name.name == p4lib.packetOut.emit.name) {
+        compileEmit(expression->arguments);
+        return false;
+    }
+    if (em != nullptr && em->originalExternType->name.name == control->program->model.register_.name) {
+        auto reg = control->getRegister(em->object->getName().name);
+        reg->emitMethodInvocation(builder, em, this);
+        return false;
+    }
+    if (em != nullptr && em->originalExternType->name.name == control->program->model.counter.name) {
+        auto ctr = control->getCounter(em->object->getName().name);
+        ctr->emitMethodInvocation(builder, em, this);
+        return false;
+    }
+    if (em != nullptr && (em->originalExternType->name.name == control->program->model.meter.name ||
+                          em->originalExternType->name.name == control->program->model.directMeter.name)) {
+        cstring name = em->object->getName().name;
+        auto meter = control->getMeter(name);
+        meter->emitMethodInvocation(builder, em, this, name == directMeter ? entryIndex : cstring());
+        return false;
+    }
     auto bim = mi->to<P4::BuiltInMethod>();
     if (bim != nullptr) {
         builder->emitIndent();
@@ -86,8 +148,12 @@ bool ControlBodyTranslator::preorder(const IR::MethodCallExpression* expression)
             builder->append(".wp4_valid");
             return false;
         } else if (bim->name == IR::Type_Header::setValid) {
+            // a header made valid is never in place in the output packet,
+            // whatever header was extracted at its offset
             visit(bim->appliedTo);
-            builder->append(".wp4_valid = true");
+            builder->append(".wp4_valid = true, ");
+            visit(bim->appliedTo);
+            builder->append(".wp4_offset = 0xffff");
             return false;
         } else if (bim->name == IR::Type_Header::setInvalid) {
             visit(bim->appliedTo);
@@ -108,123 +174,244 @@ bool ControlBodyTranslator::preorder(const IR::MethodCallExpression* expression)
     return false;
 }
 
-void ControlBodyTranslator::compileEmitField(const IR::Expression* expr, cstring field, unsigned alignment, WP4Type* type) {
-    unsigned widthToEmit = dynamic_cast<IHasWidth*>(type)->widthInBits();
-    cstring swap = "";
-    if (widthToEmit == 16)
-        swap = "htons";
-    else if (widthToEmit == 32)
-        swap = "htonl";
-    if (!swap.isNullOrEmpty()) {
-        builder->emitIndent();
-        visit(expr);
-        builder->appendFormat(".%s = %s(", field.c_str(), swap);
-        visit(expr);
-        builder->appendFormat(".%s)", field.c_str());
-        builder->endOfStatement(true);
+namespace {
+cstring hexConstant(uint64_t value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "0x%llx", static_cast<unsigned long long>(value));
+    return buf;
+}
+
+uint64_t widthMask(unsigned width) {
+    return width >= 64 ? ~0ULL : (1ULL << width) - 1;
+}
+}  // namespace
+
+void ControlBodyTranslator::emitFieldValue(const IR::Expression* expr, const IR::StructField* field) {
+    // dead fields have no storage; nothing reads them after the deparser
+    if (EliminateDeadFields::isDead(field)) {
+        builder->append("0");
+        return;
     }
+    builder->append("(u64)");
+    visit(expr);
+    builder->appendFormat(".%s", field->name.name.c_str());
+}
 
+/*
+  Writes one field of a header that starts at the (byte aligned) output
+  offset.  'offset' is the bit offset of the field within the header.
+  Byte aligned fields of 8, 16, 32 or 64 bits are written with a single
+  store; other fields are merged into the smallest word covering them that
+  stays within the header, or byte by byte if there is none.
+*/
+void ControlBodyTranslator::compileEmitField(const IR::Expression* expr, const IR::StructField* field,
+                                             unsigned offset, unsigned width, unsigned headerBytes) {
     auto program = control->program;
-    unsigned bitsInFirstByte = widthToEmit % 8;
-    if (bitsInFirstByte == 0) bitsInFirstByte = 8;
-    unsigned bitsInCurrentByte = bitsInFirstByte;
-    unsigned left = widthToEmit;
+    unsigned alignment = offset % 8;
+    unsigned byte = offset / 8;
+    unsigned bytes = (alignment + width + 7) / 8;
+    cstring ptr = program->packetStartVar + " + BYTES(" + program->offsetVar + ") + " +
+            Util::toString(byte);
 
-    for (unsigned i=0; i < (widthToEmit + 7) / 8; i++) {
-        builder->emitIndent();
-        builder->appendFormat("%s = ((char*)(&", program->byteVar.c_str());
-        visit(expr);
-        builder->appendFormat(".%s))[%d]", field.c_str(), i);
+    builder->emitIndent();
+    if (alignment == 0 && (width == 8 || width == 16 || width == 32 || width == 64)) {
+        if (width == 8) {
+            builder->appendFormat("*(%s) = ", ptr.c_str());
+            emitFieldValue(expr, field);
+        } else {
+            builder->appendFormat("put_unaligned_be%d(", width);
+            emitFieldValue(expr, field);
+            builder->appendFormat(", %s)", ptr.c_str());
+        }
         builder->endOfStatement(true);
+        return;
+    }
 
-        unsigned freeBits = alignment == 0 ? (8 - alignment) : 8;
-        unsigned bitsToWrite = bitsInCurrentByte > freeBits ? freeBits : bitsInCurrentByte;
-
-        BUG_CHECK((bitsToWrite > 0) && (bitsToWrite <= 8), "invalid bitsToWrite %d", bitsToWrite);
-        builder->emitIndent();
-        if (alignment == 0)
-            builder->appendFormat("write_byte(%s, BYTES(%s) + %d, (%s) << %d)",
-                                  " ", program->offsetVar.c_str(), i,
-                                  program->byteVar.c_str(), 8 - bitsToWrite);
-        else
-            builder->appendFormat("write_partial(%s + BYTES(%s) + %d, %d, (%s) << %d)",
-                                  " ", program->offsetVar.c_str(), i,
-                                  alignment,
-                                  program->byteVar.c_str(), 8 - bitsToWrite);
+    for (unsigned size : { 1, 2, 4, 8 }) {
+        if (size < bytes || byte + size > headerBytes)
+            continue;
+        unsigned shift = size * 8 - alignment - width;
+        cstring keep = hexConstant(~(widthMask(width) << shift) & widthMask(size * 8));
+        cstring mask = hexConstant(widthMask(width));
+        if (size == 1) {
+            builder->appendFormat("*(%s) = (*(%s) & %s) | ((", ptr.c_str(), ptr.c_str(), keep.c_str());
+            emitFieldValue(expr, field);
+            builder->appendFormat(" & %s) << %d)", mask.c_str(), shift);
+        } else {
+            builder->appendFormat("put_unaligned_be%d((get_unaligned_be%d(%s) & %s) | ((",
+                                  size * 8, size * 8, ptr.c_str(), keep.c_str());
+            emitFieldValue(expr, field);
+            builder->appendFormat(" & %s) << %d), %s)", mask.c_str(), shift, ptr.c_str());
+        }
         builder->endOfStatement(true);
-        left -= bitsToWrite;
-        bitsInCurrentByte -= bitsToWrite;
+        return;
+    }
 
-        if (bitsInCurrentByte > 0) {
+    bool first = true;
+    for (unsigned i = 0; i < bytes; i++) {
+        unsigned low = std::max(alignment, i * 8);
+        unsigned high = std::min(alignment + width, i * 8 + 8);
+        unsigned valueShift = alignment + width - high;
+        unsigned byteShift = i * 8 + 8 - high;
+        if (!first)
             builder->emitIndent();
-            builder->appendFormat(
-                "write_byte(%s, BYTES(%s) + %d + 1, (%s << %d))",
-                " ",
-                program->offsetVar.c_str(), i, program->byteVar.c_str(), 8 - alignment % 8);
-            builder->endOfStatement(true);
-            left -= bitsInCurrentByte;
+        first = false;
+        if (high - low == 8) {
+            builder->appendFormat("(%s)[%d] = (u8)(", ptr.c_str(), i);
+            emitFieldValue(expr, field);
+            builder->appendFormat(" >> %d)", valueShift);
+        } else {
+            cstring keep = hexConstant(~(widthMask(high - low) << byteShift) & 0xff);
+            builder->appendFormat("(%s)[%d] = ((%s)[%d] & %s) | (u8)(((", ptr.c_str(), i,
+                                  ptr.c_str(), i, keep.c_str());
+            emitFieldValue(expr, field);
+            builder->appendFormat(" >> %d) & %s) << %d)", valueShift,
+                                  hexConstant(widthMask(high - low)).c_str(), byteShift);
         }
-
-        alignment = (alignment + bitsToWrite) % 8;
-        bitsInCurrentByte = left >= 8 ? 8 : left;
+        builder->endOfStatement(true);
     }
-
-    builder->emitIndent();
-    builder->appendFormat("%s += %d", program->offsetVar.c_str(), widthToEmit);
-    builder->endOfStatement(true);
 }
 
+/*
+  A header that is emitted where it was extracted (after the frame has
+  been resized, see WP4Deparser::emit) only needs the fields that may have
+  been modified (see FindDirtyFields) to be written back; the other bytes
+  are already in the packet.  Headers that moved or were added by the
+  control are written completely.  A header stack is emitted element by
+  element, unrolled to its size.
+*/
 void ControlBodyTranslator::compileEmit(const IR::Vector<IR::Argument>* args) {
     BUG_CHECK(args->size() == 1, "%1%: expected 1 argument for emit", args);
 
     auto expr = args->at(0)->expression;
     auto type = typeMap->getType(expr);
+    if (auto st = type->to<IR::Type_Stack>()) {
+        auto et = typeMap->getTypeType(st->elementType, true)->to<IR::Type_Header>();
+        BUG_CHECK(et != nullptr, "%1%: expected a header stack", expr);
+        for (unsigned i = 0; i < st->getSize(); i++)
+            compileEmitHeader(new IR::ArrayIndex(expr, new IR::Constant(i)), et);
+        return;
+    }
     auto ht = type->to<IR::Type_Header>();
     if (ht == nullptr) {
         ::error("Cannot emit a non-header type %1%", expr);
         return;
     }
+    compileEmitHeader(expr, ht);
+}
 
-    auto program = control->program;
-    builder->emitIndent();
-    builder->append("if (");
-    visit(expr);
-    builder->append(".wp4_valid) ");
-    builder->blockStart();
-
+void ControlBodyTranslator::compileEmitHeader(const IR::Expression* expr, const IR::Type_Header* ht) {
     unsigned width = ht->width_bits();
-    builder->emitIndent();
-    builder->appendFormat("if (%s < %s + BYTES(%s + %d)) ",
-                          " ",
-                          " ",
-                          program->offsetVar.c_str(), width);
-    builder->blockStart();
-
-    builder->emitIndent();
-    builder->appendFormat("%s = %s;", program->errorVar.c_str(), p4lib.packetTooShort.str());
-    builder->newline();
-
-    builder->emitIndent();
-    builder->appendFormat("return %s;", builder->target->abortReturnCode().c_str());
-    builder->newline();
-    builder->blockEnd(true);
+    // a varbit field, which must come last, is copied after the others
+    const IR::StructField* varbit = nullptr;
+    for (auto f : ht->fields) {
+        if (auto vt = typeMap->getType(f)->to<IR::Type_Varbits>()) {
+            varbit = f;
+            width -= vt->size;
+        }
+    }
+    if (varbit != nullptr && varbit != ht->fields.back()) {
+        ::error("%1%: only headers that end with their varbit field can be emitted", expr);
+        return;
+    }
+    if (width % 8 != 0) {
+        ::error("%1%: only headers with a width that is a multiple of 8 can be emitted", expr);
+        return;
+    }
 
-    unsigned alignment = 0;
+    struct FieldInfo {
+        const IR::StructField* field;
+        unsigned offset;
+        unsigned width;
+        bool dirty;
+    };
+    auto program = control->program;
+    std::vector<FieldInfo> fields;
+    unsigned offset = 0;
+    unsigned dirtyCount = 0;
     for (auto f : ht->fields) {
-        auto ftype = typeMap->getType(f);
-        auto etype = WP4TypeFactory::instance->create(ftype);
+        if (f == varbit)
+            continue;
+        auto etype = WP4TypeFactory::instance->create(typeMap->getType(f));
         auto et = dynamic_cast<IHasWidth*>(etype);
         if (et == nullptr) {
             ::error("Only headers with fixed widths supported %1%", f);
             return;
         }
-        compileEmitField(expr, f->name, alignment, etype);
-        alignment += et->widthInBits();
-        alignment %= 8;
+        unsigned fwidth = et->widthInBits();
+        if (fwidth > 64) {
+            ::error("%1%: fields wider than 64 bits cannot be emitted", f);
+            return;
+        }
+        bool dirty = program->dirtyFields.contains(ht->name.name, f->name.name);
+        if (dirty)
+            dirtyCount++;
+        fields.push_back({ f, offset, fwidth, dirty });
+        offset += fwidth;
+    }
+
+    bool varbitDirty = varbit != nullptr &&
+            program->dirtyFields.contains(ht->name.name, varbit->name.name);
+    if (varbitDirty)
+        dirtyCount++;
+    unsigned emitted = fields.size() + (varbit != nullptr ? 1 : 0);
+    auto emitVarbit = [&]() {
+        builder->emitIndent();
+        builder->appendFormat("memcpy(%s + BYTES(%s) + %d, ", program->packetStartVar.c_str(),
+                              program->offsetVar.c_str(), width / 8);
+        visit(expr);
+        builder->appendFormat(".%s, BYTES(", varbit->name.name.c_str());
+        visit(expr);
+        builder->appendFormat(".%s))", WP4VarbitType::lengthField().c_str());
+        builder->endOfStatement(true);
+    };
+
+    builder->emitIndent();
+    builder->append("if (");
+    visit(expr);
+    builder->append(".wp4_valid) ");
+    builder->blockStart();
+
+    if (dirtyCount == emitted) {
+        for (auto& f : fields)
+            compileEmitField(expr, f.field, f.offset, f.width, width / 8);
+        if (varbit != nullptr)
+            emitVarbit();
+    } else {
+        builder->emitIndent();
+        builder->append("if (");
+        visit(expr);
+        builder->append(".wp4_offset == 0xffff || ");
+        visit(expr);
+        builder->appendFormat(".wp4_offset + 8 * %s != %s) ",
+                              program->headerDeltaVar.c_str(), program->offsetVar.c_str());
+        builder->blockStart();
+        for (auto& f : fields)
+            compileEmitField(expr, f.field, f.offset, f.width, width / 8);
+        if (varbit != nullptr)
+            emitVarbit();
+        builder->blockEnd(dirtyCount == 0);
+        if (dirtyCount != 0) {
+            builder->append(" else ");
+            builder->blockStart();
+            for (auto& f : fields)
+                if (f.dirty)
+                    compileEmitField(expr, f.field, f.offset, f.width, width / 8);
+            if (varbitDirty)
+                emitVarbit();
+            builder->blockEnd(true);
+        }
     }
 
+    builder->emitIndent();
+    builder->appendFormat("%s += %d", program->offsetVar.c_str(), width);
+    if (varbit != nullptr) {
+        builder->append(" + ");
+        visit(expr);
+        builder->appendFormat(".%s", WP4VarbitType::lengthField().c_str());
+    }
+    builder->endOfStatement(true);
     builder->blockEnd(true);
-    return;
 }
 
 void ControlBodyTranslator::processApply(const P4::ApplyMethod* method) {
@@ -260,17 +447,26 @@ void ControlBodyTranslator::processApply(const P4::ApplyMethod* method) {
     cstring valueName = "value";
     builder->appendFormat("struct %s *%s = NULL", table->valueTypeName.c_str(), valueName.c_str());
     builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("struct %s %s_default", table->valueTypeName.c_str(), valueName.c_str());
+    builder->endOfStatement(true);
 
     if (table->keyGenerator != nullptr) {
         builder->emitIndent();
         builder->appendLine("/* perform lookup */");
-        builder->emitIndent();
-        builder->target->emitTableLookup(builder, table->dataMapName, keyname, valueName);
-        builder->endOfStatement(true);
+        table->emitLookup(builder, keyname, valueName);
+        table->emitIdleExpiry(builder, keyname, valueName);
     }
 
+    auto profile = control->program->profile;
+    cstring hitName = WP4Profile::tableHit(table->instanceName);
+    cstring missName = WP4Profile::tableMiss(table->instanceName);
+    cstring missCondition = valueName + " == NULL";
+    cstring hint = profile->hint(profile->count(missName), profile->count(hitName));
+    if (!hint.isNullOrEmpty())
+        missCondition = hint + "(" + missCondition + ")";
     builder->emitIndent();
-    builder->appendFormat("if (%s == NULL) ", valueName.c_str());
+    builder->appendFormat("if (%s) ", missCondition.c_str());
     builder->blockStart();
 
     builder->emitIndent();
@@ -278,16 +474,24 @@ void ControlBodyTranslator::processApply(const P4::ApplyMethod* method) {
     builder->emitIndent();
     builder->appendFormat("%s = 0", control->hitVariable.c_str());
     builder->endOfStatement(true);
+    cstring count = profile->increment(missName);
+    if (!count.isNullOrEmpty()) {
+        builder->emitIndent();
+        builder->appendLine(count);
+    }
 
-    builder->emitIndent();
-    builder->target->emitTableLookup(builder, table->defaultActionMapName, control->program->zeroKey, valueName);
-    builder->endOfStatement(true);
+    table->emitDefaultLookup(builder, valueName);
     builder->blockEnd(false);
     builder->append(" else ");
     builder->blockStart();
     builder->emitIndent();
     builder->appendFormat("%s = 1", control->hitVariable.c_str());
     builder->endOfStatement(true);
+    count = profile->increment(hitName);
+    if (!count.isNullOrEmpty()) {
+        builder->emitIndent();
+        builder->appendLine(count);
+    }
     builder->blockEnd(true);
 
     builder->emitIndent();
@@ -407,20 +611,59 @@ bool ControlBodyTranslator::preorder(const IR::SwitchStatement* statement) {
 
 WP4Control::WP4Control(const WP4Program* program, const IR::ControlBlock* block, const IR::Parameter* parserHeaders) :
         program(program), controlBlock(block), headers(nullptr),
-        accept(nullptr), parserHeaders(parserHeaders), codeGen(nullptr) {}
+        accept(nullptr), parserHeaders(parserHeaders), codeGen(nullptr) {
+    tablesDir = WP4Model::reserved("tables_dir");
+    countersDir = WP4Model::reserved("counters_dir");
+    metersDir = WP4Model::reserved("meters_dir");
+}
 
 void WP4Control::scanConstants() {
+    auto& model = program->model;
     for (auto c : controlBlock->constantValue) {
         auto b = c.second;
         if (!b->is<IR::Block>()) continue;
         if (b->is<IR::TableBlock>()) {
             auto tblblk = b->to<IR::TableBlock>();
-            auto tbl = new WP4Table(program, tblblk, codeGen);
+            auto tbl = new WP4Table(program, this, tblblk, codeGen);
             tables.emplace(tblblk->container->name, tbl);
+            continue;
+        }
+        auto extblk = b->to<IR::ExternBlock>();
+        if (extblk == nullptr) {
+            ::error("Unexpected block %s nested within control", b->toString());
+            continue;
+        }
+        cstring name = extblk->node->to<IR::Declaration_Instance>()->name;
+        if (extblk->type->name == model.register_.name) {
+            registers.emplace(name, new WP4Register(program, extblk));
+        } else if (extblk->type->name == model.counter.name) {
+            counters.emplace(name, new WP4Counter(program, extblk, false));
+        } else if (extblk->type->name == model.directCounter.name) {
+            counters.emplace(name, new WP4Counter(program, extblk, true));
+        } else if (extblk->type->name == model.meter.name) {
+            meters.emplace(name, new WP4Meter(program, extblk, false));
+        } else if (extblk->type->name == model.directMeter.name) {
+            meters.emplace(name, new WP4Meter(program, extblk, true));
         } else {
             ::error("Unexpected block %s nested within control", b->toString());
         }
     }
+
+    for (auto it : tables) {
+        auto tbl = it.second;
+        if (!tbl->counterName.isNullOrEmpty()) {
+            auto ctr = ::get(counters, tbl->counterName);
+            if (ctr == nullptr || !ctr->isDirect)
+                ::error("%1%: property '%2%' must name a %3% instance", tbl->table->container,
+                        model.directCounter.counters.name, model.directCounter.name);
+        }
+        if (!tbl->meterName.isNullOrEmpty()) {
+            auto meter = ::get(meters, tbl->meterName);
+            if (meter == nullptr || !meter->isDirect)
+                ::error("%1%: property '%2%' must name a %3% instance", tbl->table->container,
+                        model.directMeter.meters.name, model.directMeter.name);
+        }
+    }
 }
 
 bool WP4Control::build() {
@@ -482,9 +725,106 @@ void WP4Control::emitTableTypes(CodeBuilder* builder) {
         it.second->emitTypes(builder);
 }
 
-void WP4Control::emitTableInitializers(CodeBuilder* builder) {
+void WP4Control::emitExternInstances(CodeBuilder* builder) {
+    if (!tables.empty()) {
+        builder->emitIndent();
+        builder->appendFormat("static struct dentry *%s;", tablesDir.c_str());
+        builder->newline();
+        builder->appendLine("static const struct file_operations wp4_table_fops = {\n"
+                            "    .owner = THIS_MODULE,\n"
+                            "    .open = wp4_table_open,\n"
+                            "    .release = wp4_table_release,\n"
+                            "    .read = wp4_table_read,\n"
+                            "    .write = wp4_table_write,\n"
+                            "    .unlocked_ioctl = wp4_table_ioctl,\n"
+                            "    .compat_ioctl = compat_ptr_ioctl,\n"
+                            "    .llseek = default_llseek,\n"
+                            "};");
+    }
     for (auto it : tables)
-        it.second->emitInitializer(builder);
+        it.second->emitInstance(builder);
+    for (auto it : registers)
+        it.second->emitInstance(builder);
+    if (!counters.empty()) {
+        builder->emitIndent();
+        builder->appendFormat("static struct dentry *%s;", countersDir.c_str());
+        builder->newline();
+        builder->appendLine("static const struct file_operations wp4_counter_fops = {\n"
+                            "    .owner = THIS_MODULE,\n"
+                            "    .open = simple_open,\n"
+                            "    .read = wp4_counter_read,\n"
+                            "    .llseek = default_llseek,\n"
+                            "};");
+        for (auto it : counters)
+            it.second->emitInstance(builder);
+    }
+    if (!meters.empty()) {
+        builder->emitIndent();
+        builder->appendFormat("static struct dentry *%s;", metersDir.c_str());
+        builder->newline();
+        builder->appendLine("static const struct file_operations wp4_meter_fops = {\n"
+                            "    .owner = THIS_MODULE,\n"
+                            "    .open = simple_open,\n"
+                            "    .write = wp4_meter_write,\n"
+                            "    .llseek = default_llseek,\n"
+                            "};");
+        for (auto it : meters)
+            it.second->emitInstance(builder);
+    }
+}
+
+bool WP4Control::emitExternInit(CodeBuilder* builder, cstring failLabel) {
+    bool allocates = false;
+    if (!tables.empty()) {
+        builder->emitIndent();
+        builder->appendFormat("%s = debugfs_create_dir(\"wp4_tables\", NULL);", tablesDir.c_str());
+        builder->newline();
+    }
+    for (auto it : tables)
+        allocates |= it.second->emitAllocation(builder, tablesDir, failLabel);
+    for (auto it : registers)
+        allocates |= it.second->emitAllocation(builder, failLabel);
+    if (!meters.empty()) {
+        builder->emitIndent();
+        builder->appendFormat("%s = debugfs_create_dir(\"wp4_meters\", NULL);", metersDir.c_str());
+        builder->newline();
+        for (auto it : meters)
+            it.second->emitAllocation(builder, metersDir);
+    }
+    if (counters.empty())
+        return allocates;
+    builder->emitIndent();
+    builder->appendFormat("%s = debugfs_create_dir(\"wp4_counters\", NULL);", countersDir.c_str());
+    builder->newline();
+    for (auto it : counters)
+        it.second->emitAllocation(builder, countersDir, failLabel);
+    return true;
+}
+
+void WP4Control::emitExternExit(CodeBuilder* builder) {
+    if (!tables.empty()) {
+        // no update may be in progress once the entries are freed
+        builder->emitIndent();
+        builder->appendFormat("debugfs_remove_recursive(%s);", tablesDir.c_str());
+        builder->newline();
+    }
+    if (!meters.empty()) {
+        builder->emitIndent();
+        builder->appendFormat("debugfs_remove_recursive(%s);", metersDir.c_str());
+        builder->newline();
+    }
+    if (!counters.empty()) {
+        // no reads may be in progress once the files are removed
+        builder->emitIndent();
+        builder->appendFormat("debugfs_remove_recursive(%s);", countersDir.c_str());
+        builder->newline();
+    }
+    for (auto it : tables)
+        it.second->emitFree(builder);
+    for (auto it : registers)
+        it.second->emitFree(builder);
+    for (auto it : counters)
+        it.second->emitFree(builder);
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -542,20 +882,49 @@ class OutHeaderSize final : public CodeGenInspector {
             return illegal(statement);
         }
 
-        auto h = method->expr->arguments->at(0);
+        auto h = method->expr->arguments->at(0)->expression;
         auto type = typeMap->getType(h);
+        if (auto st = type->to<IR::Type_Stack>()) {
+            auto et = typeMap->getTypeType(st->elementType, true)->to<IR::Type_Header>();
+            BUG_CHECK(et != nullptr, "%1%: expected a header stack", h);
+            for (unsigned i = 0; i < st->getSize(); i++) {
+                if (i != 0) {
+                    builder->newline();
+                    builder->emitIndent();
+                }
+                emitSize(new IR::ArrayIndex(h, new IR::Constant(i)), et);
+            }
+            return false;
+        }
         auto ht = type->to<IR::Type_Header>();
         if (ht == nullptr) {
             ::error("Cannot emit a non-header type %1%", h);
             return false;
         }
+        emitSize(h, ht);
+        return false;
+    }
+
+    void emitSize(const IR::Expression* h, const IR::Type_Header* ht) {
         unsigned width = ht->width_bits();
+        const IR::StructField* varbit = nullptr;
+        for (auto f : ht->fields) {
+            if (auto vt = typeMap->getType(f)->to<IR::Type_Varbits>()) {
+                varbit = f;
+                width -= vt->size;
+            }
+        }
 
         builder->append("if (");
         visit(h);
         builder->append(".wp4_valid) ");
-        builder->appendFormat("%s += %d;", program->outHeaderLengthVar.c_str(), width);
-        return false;
+        builder->appendFormat("%s += %d", program->outHeaderLengthVar.c_str(), width);
+        if (varbit != nullptr) {
+            builder->append(" + ");
+            visit(h);
+            builder->appendFormat(".%s", WP4VarbitType::lengthField().c_str());
+        }
+        builder->append(";");
     }
 
     void substitute(const IR::Parameter* p, const IR::Parameter* with)
@@ -590,8 +959,59 @@ void WP4Deparser::emit(CodeBuilder* builder) {
     ohs.substitute(headers, parserHeaders);
     ohs.setBuilder(builder);
 
+    // exit statements in the control jump here
+    builder->emitIndent();
+    builder->appendFormat("%s:", program->endLabel.c_str());
+    builder->newline();
+    if (program->flowCache != nullptr)
+        program->flowCache->emitFill(builder);
+    auto omd = program->getSwitch()->outputMeta->name.name;
+    builder->emitIndent();
+    builder->appendFormat("if (%s.%s) return %s;", omd.c_str(),
+                          WP4Model::instance.outputMetadataModel.drop.str(),
+                          builder->target->dropReturnCode().c_str());
+    builder->newline();
+    builder->emitIndent();
+    (void)controlBlock->container->body->apply(ohs);
+    builder->newline();
+
+    // The payload stays where it is: the frame start moves by the change in
+    // header size, once, within the headroom.  Headers that were parsed
+    // move along with it, so in-place headers are found 'delta' bytes
+    // further into the frame.
+    auto p = program;
+    cstring delta = p->headerDeltaVar;
+    builder->emitIndent();
+    builder->appendFormat("%s = BYTES(%s) - BYTES(%s);", delta.c_str(),
+                          p->outHeaderLengthVar.c_str(), p->offsetVar.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("if (skb_cow_head(%s, %s > 0 ? %s : 0)) return %s;",
+                          p->skbVar.c_str(), delta.c_str(), delta.c_str(),
+                          builder->target->abortReturnCode().c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("if (%s > 0) skb_push(%s, %s);", delta.c_str(), p->skbVar.c_str(), delta.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("else if (%s < 0) skb_pull(%s, -%s);", delta.c_str(), p->skbVar.c_str(), delta.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("%s = %s->data;", p->packetStartVar.c_str(), p->skbVar.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("%s = 0;", p->offsetVar.c_str());
+    builder->newline();
+
+    builder->emitIndent();
+    codeGen->setBuilder(builder);
+    controlBlock->container->body->apply(*codeGen);
+    builder->newline();
+
     builder->emitIndent();
-    //(void)controlBlock->container->body->apply(ohs);
+    builder->appendFormat("if (%s && wp4_fcs_update(%s)) return %s;",
+                          p->fcsUpdateVar.c_str(), p->skbVar.c_str(),
+                          builder->target->abortReturnCode().c_str());
     builder->newline();
 }
 
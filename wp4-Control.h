@@ -19,6 +19,9 @@ limitations under the License.
 
 #include "wp4-Object.h"
 #include "wp4-Table.h"
+#include "wp4-Register.h"
+#include "wp4-Counter.h"
+#include "wp4-Meter.h"
 
 namespace WP4 {
 
@@ -26,18 +29,27 @@ class WP4Control;
 class WP4Deparser;
 
 class ControlBodyTranslator : public CodeGenInspector {
+ protected:
     const WP4Control* control;
+ private:
     std::set<const IR::Parameter*> toDereference;
     std::vector<cstring> saveAction;
     P4::P4CoreLibrary& p4lib;
  public:
+    // set while translating the actions of a table with a direct meter
+    cstring directMeter, entryIndex;
+
     explicit ControlBodyTranslator(const WP4Control* control);
 
     // handle the packet_out.emit method
-    virtual void compileEmitField(const IR::Expression* expr, cstring field, unsigned alignment, WP4Type* type);
+    void emitFieldValue(const IR::Expression* expr, const IR::StructField* field);
+    virtual void compileEmitField(const IR::Expression* expr, const IR::StructField* field,
+                                  unsigned offset, unsigned width, unsigned headerBytes);
     virtual void compileEmit(const IR::Vector<IR::Argument>* args);
+    void compileEmitHeader(const IR::Expression* expr, const IR::Type_Header* ht);
     virtual void processApply(const P4::ApplyMethod* method);
     virtual void processFunction(const P4::ExternFunction* function);
+    virtual void compileCsumUpdate(const P4::ExternFunction* function);
 
     bool preorder(const IR::PathExpression* expression) override;
     bool preorder(const IR::MethodCallExpression* expression) override;
@@ -62,18 +74,37 @@ class WP4Control : public WP4Object {
 
     std::set<const IR::Parameter*> toDereference;
     std::map<cstring, WP4Table*>  tables;
+    std::map<cstring, WP4Register*>  registers;
+    std::map<cstring, WP4Counter*>   counters;
+    std::map<cstring, WP4Meter*>     meters;
+    cstring                 tablesDir, countersDir, metersDir;
 
     WP4Control(const WP4Program* program, const IR::ControlBlock* block, const IR::Parameter* parserHeaders);
     virtual void emit(CodeBuilder* builder);
     void emitDeclaration(CodeBuilder* builder, const IR::Declaration* decl);
     void emitTableTypes(CodeBuilder* builder);
-    void emitTableInitializers(CodeBuilder* builder);
     void emitTableInstances(CodeBuilder* builder);
     virtual bool build();
     WP4Table* getTable(cstring name) const {
         auto result = ::get(tables, name);
         BUG_CHECK(result != nullptr, "No table named %1%", name);
         return result; }
+    WP4Register* getRegister(cstring name) const {
+        auto result = ::get(registers, name);
+        BUG_CHECK(result != nullptr, "No register named %1%", name);
+        return result; }
+    WP4Counter* getCounter(cstring name) const {
+        auto result = ::get(counters, name);
+        BUG_CHECK(result != nullptr, "No counter named %1%", name);
+        return result; }
+    WP4Meter* getMeter(cstring name) const {
+        auto result = ::get(meters, name);
+        BUG_CHECK(result != nullptr, "No meter named %1%", name);
+        return result; }
+    // storage of the extern instances and its setup in the module init and exit
+    void emitExternInstances(CodeBuilder* builder);
+    bool emitExternInit(CodeBuilder* builder, cstring failLabel);  // true if it can fail
+    void emitExternExit(CodeBuilder* builder);
 
  protected:
     void scanConstants();
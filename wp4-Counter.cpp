@@ -0,0 +1,123 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#include "wp4-Counter.h"
+#include "lib/error.h"
+
+namespace WP4 {
+
+WP4Counter::WP4Counter(const WP4Program* program, const IR::ExternBlock* block, bool isDirect) :
+        program(program), block(block), isDirect(isDirect),
+        countPackets(true), countBytes(true) {
+    auto di = block->node->to<IR::Declaration_Instance>();
+    BUG_CHECK(di != nullptr, "%1%: expected an instance", block->node);
+    instanceName = WP4Object::externalName(di);
+    setName = instanceName + "_set";
+    auto& model = program->model;
+
+    if (isDirect) {
+        // per-CPU elements indexed by the wp4_flow of the entry
+        size = "MAX_FLOWS";
+    } else {
+        auto sz = block->getParameterValue(model.counter.size.name)->to<IR::Constant>();
+        if (sz == nullptr || sz->value <= 0) {
+            ::error("%1%: counter size must be a positive constant", di);
+            return;
+        }
+        size = Util::toString(sz->asUnsigned());
+    }
+
+    auto type = block->getParameterValue(isDirect ? model.directCounter.type.name
+                                                  : model.counter.type.name);
+    auto id = type->to<IR::Declaration_ID>();
+    if (id == nullptr) {
+        ::error("%1%: counter type must be a constant", di);
+        return;
+    }
+    if (id->name == model.counterType.packets.name)
+        countBytes = false;
+    else if (id->name == model.counterType.bytes.name)
+        countPackets = false;
+}
+
+void WP4Counter::emitInstance(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->appendFormat("static struct wp4_counter __percpu *%s;", instanceName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("static struct wp4_counter_set %s = { .size = %s };",
+                          setName.c_str(), size.c_str());
+    builder->newline();
+}
+
+void WP4Counter::emitAllocation(CodeBuilder* builder, cstring dirName, cstring failLabel) {
+    builder->emitIndent();
+    builder->appendFormat("%s = __alloc_percpu(%s * sizeof(struct wp4_counter), "
+                          "__alignof__(struct wp4_counter));", instanceName.c_str(), size.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("if (!%s) goto %s;", instanceName.c_str(), failLabel.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("%s.counters = %s;", setName.c_str(), instanceName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("debugfs_create_file(\"%s\", 0444, %s, &%s, &wp4_counter_fops);",
+                          instanceName.c_str(), dirName.c_str(), setName.c_str());
+    builder->newline();
+}
+
+void WP4Counter::emitFree(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->appendFormat("free_percpu(%s);", instanceName.c_str());
+    builder->newline();
+}
+
+void WP4Counter::emitCount(CodeBuilder* builder, cstring index) {
+    builder->emitIndent();
+    builder->appendFormat("if (%s < %s) ", index.c_str(), size.c_str());
+    builder->blockStart();
+    if (countPackets) {
+        builder->emitIndent();
+        builder->appendFormat("this_cpu_inc(%s[%s].packets);", instanceName.c_str(), index.c_str());
+        builder->newline();
+    }
+    if (countBytes) {
+        builder->emitIndent();
+        builder->appendFormat("this_cpu_add(%s[%s].bytes, %s->len);", instanceName.c_str(),
+                              index.c_str(), program->skbVar.c_str());
+        builder->newline();
+    }
+    builder->blockEnd(true);
+}
+
+void WP4Counter::emitMethodInvocation(CodeBuilder* builder, const P4::ExternMethod* method,
+                                      CodeGenInspector* codeGen) {
+    BUG_CHECK(method->method->name.name == program->model.counter.count.name,
+              "%1%: unexpected counter method", method->expr);
+    cstring index = WP4Model::reserved("index");
+    builder->emitIndent();
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("u32 %s = ", index.c_str());
+    codeGen->emitMasked(method->expr->arguments->at(0)->expression);
+    builder->endOfStatement(true);
+    emitCount(builder, index);
+    builder->blockEnd(false);
+}
+
+}  // namespace WP4
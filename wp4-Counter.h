@@ -0,0 +1,52 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#ifndef _BACKENDS_WP4_WP4COUNTER_H_
+#define _BACKENDS_WP4_WP4COUNTER_H_
+
+#include "wp4-Object.h"
+#include "wp4-Program.h"
+#include "frontends/p4/methodInstance.h"
+
+namespace WP4 {
+
+// An instance of the counter or direct_counter extern: a per-CPU array of
+// struct wp4_counter, exported through debugfs as a struct wp4_counter_set.
+class WP4Counter : public WP4Object {
+ public:
+    const WP4Program*      program;
+    const IR::ExternBlock* block;
+    cstring                instanceName;
+    cstring                setName;
+    cstring                size;  // a C expression
+    bool                   isDirect;
+    bool                   countPackets;
+    bool                   countBytes;
+
+    WP4Counter(const WP4Program* program, const IR::ExternBlock* block, bool isDirect);
+    void emitInstance(CodeBuilder* builder);
+    void emitAllocation(CodeBuilder* builder, cstring dirName, cstring failLabel);
+    void emitFree(CodeBuilder* builder);
+    // counts the current frame into element 'index'
+    void emitCount(CodeBuilder* builder, cstring index);
+    void emitMethodInvocation(CodeBuilder* builder, const P4::ExternMethod* method,
+                              CodeGenInspector* codeGen);
+};
+
+}  // namespace WP4
+
+#endif /* _BACKENDS_WP4_WP4COUNTER_H_ */
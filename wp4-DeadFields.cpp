@@ -0,0 +1,132 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "wp4-DeadFields.h"
+#include "frontends/p4/coreLibrary.h"
+#include "frontends/p4/methodInstance.h"
+
+namespace WP4 {
+
+const cstring EliminateDeadFields::annotation = "wp4_dead";
+
+void FieldSet::addType(const IR::Type* type) {
+    if (type == nullptr)
+        return;
+    if (auto ht = type->to<IR::Type_Header>()) {
+        headers.emplace(ht->name.name);
+    } else if (auto st = type->to<IR::Type_StructLike>()) {
+        for (auto f : st->fields)
+            addType(f->type);
+    } else if (auto ts = type->to<IR::Type_Stack>()) {
+        addType(ts->elementType);
+    }
+}
+
+bool FieldSet::contains(cstring header, cstring field) const {
+    if (headers.count(header) != 0)
+        return true;
+    auto it = fields.find(header);
+    return it != fields.end() && it->second.count(field) != 0;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// Stack indices are evaluated even when the stack element is only written.
+void FindLiveFields::visitIndices(const IR::Expression* expression) {
+    while (true) {
+        if (auto ai = expression->to<IR::ArrayIndex>()) {
+            visit(ai->right);
+            expression = ai->left;
+        } else if (auto m = expression->to<IR::Member>()) {
+            expression = m->expr;
+        } else {
+            return;
+        }
+    }
+}
+
+bool FindLiveFields::preorder(const IR::Member* member) {
+    auto baseType = typeMap->getType(member->expr);
+    if (baseType == nullptr)
+        return true;
+    if (auto ht = baseType->to<IR::Type_Header>()) {
+        // Header methods such as isValid() only touch the validity bit
+        if (ht->getField(member->member) != nullptr)
+            live->addField(ht->name.name, member->member.name);
+        visitIndices(member->expr);
+        return false;
+    }
+    if (baseType->is<IR::Type_StructLike>() || baseType->is<IR::Type_Stack>()) {
+        // A header reached here is not the base of a field access,
+        // so it is used as a whole.
+        live->addType(typeMap->getType(member));
+        visitIndices(member->expr);
+        return false;
+    }
+    return true;
+}
+
+bool FindLiveFields::preorder(const IR::PathExpression* expression) {
+    live->addType(typeMap->getType(expression));
+    return false;
+}
+
+bool FindLiveFields::preorder(const IR::ArrayIndex* expression) {
+    live->addType(typeMap->getType(expression));
+    visitIndices(expression);
+    return false;
+}
+
+bool FindLiveFields::preorder(const IR::MethodCallExpression* expression) {
+    auto mi = P4::MethodInstance::resolve(expression, refMap, typeMap);
+    if (auto em = mi->to<P4::ExternMethod>()) {
+        auto& p4lib = P4::P4CoreLibrary::instance;
+        if (em->originalExternType->name.name == p4lib.packetIn.name &&
+            em->method->name.name == p4lib.packetIn.extract.name) {
+            // Extracting writes the destination; only a size argument is read
+            auto args = expression->arguments;
+            if (args->size() > 0)
+                visitIndices(args->at(0)->expression);
+            for (size_t i = 1; i < args->size(); i++)
+                visit(args->at(i)->expression);
+            return false;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////
+
+const IR::Node* MarkDeadFields::postorder(IR::Type_Header* header) {
+    IR::IndexedVector<IR::StructField> fields;
+    bool changed = false;
+    for (auto f : header->fields) {
+        if (live->contains(header->name.name, f->name.name) || EliminateDeadFields::isDead(f)) {
+            fields.push_back(f);
+            continue;
+        }
+        auto annos = new IR::Annotations(f->annotations->annotations);
+        annos->annotations.push_back(new IR::Annotation(EliminateDeadFields::annotation, {}));
+        fields.push_back(new IR::StructField(f->srcInfo, f->name, annos, f->type));
+        LOG2("Dead field " << header->name << "." << f->name);
+        changed = true;
+    }
+    if (changed)
+        header->fields = fields;
+    return header;
+}
+
+}  // namespace WP4
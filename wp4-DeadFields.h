@@ -0,0 +1,97 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_WP4_DEADFIELDS_H_
+#define _BACKENDS_WP4_DEADFIELDS_H_
+
+#include "ir/ir.h"
+#include "frontends/p4/typeChecking/typeChecker.h"
+#include "frontends/common/resolveReferences/resolveReferences.h"
+
+namespace WP4 {
+
+// A set of header fields, by header type.
+class FieldSet {
+    // header type name -> fields
+    std::map<cstring, std::set<cstring>> fields;
+    // header types all of whose fields are in the set
+    std::set<cstring> headers;
+
+ public:
+    void addField(cstring header, cstring field)
+    { fields[header].emplace(field); }
+    void addType(const IR::Type* type);
+    bool contains(cstring header, cstring field) const;
+};
+
+/**
+  Collects every header field that is read by the parser (select
+  expressions), by the control (including table keys and actions) or by the
+  deparser.  A header that is extracted is not a use of its fields; a header
+  used as a whole keeps all of its fields.
+*/
+class FindLiveFields : public Inspector {
+    P4::ReferenceMap* refMap;
+    P4::TypeMap*      typeMap;
+    FieldSet*         live;
+
+    void visitIndices(const IR::Expression* expression);
+
+ public:
+    FindLiveFields(P4::ReferenceMap* refMap, P4::TypeMap* typeMap, FieldSet* live) :
+            refMap(refMap), typeMap(typeMap), live(live)
+    { CHECK_NULL(refMap); CHECK_NULL(typeMap); CHECK_NULL(live); setName("FindLiveFields"); }
+
+    bool preorder(const IR::Member* member) override;
+    bool preorder(const IR::PathExpression* expression) override;
+    bool preorder(const IR::ArrayIndex* expression) override;
+    bool preorder(const IR::MethodCallExpression* expression) override;
+};
+
+/**
+  Annotates the fields that FindLiveFields did not see with @wp4_dead.
+  The backend does not allocate storage for such fields and the parser only
+  advances the packet offset over them.
+*/
+class MarkDeadFields : public Transform {
+    const FieldSet* live;
+
+ public:
+    explicit MarkDeadFields(const FieldSet* live) : live(live)
+    { CHECK_NULL(live); setName("MarkDeadFields"); }
+
+    const IR::Node* postorder(IR::Type_Header* header) override;
+};
+
+class EliminateDeadFields : public PassManager {
+    FieldSet live;
+
+ public:
+    static const cstring annotation;
+    static bool isDead(const IR::StructField* field)
+    { return field->getAnnotation(annotation) != nullptr; }
+
+    EliminateDeadFields(P4::ReferenceMap* refMap, P4::TypeMap* typeMap) {
+        setName("EliminateDeadFields");
+        passes.push_back(new P4::TypeChecking(refMap, typeMap));
+        passes.push_back(new FindLiveFields(refMap, typeMap, &live));
+        passes.push_back(new MarkDeadFields(&live));
+    }
+};
+
+}  // namespace WP4
+
+#endif  /* _BACKENDS_WP4_DEADFIELDS_H_ */
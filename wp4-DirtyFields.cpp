@@ -0,0 +1,61 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "wp4-DirtyFields.h"
+#include "frontends/p4/coreLibrary.h"
+#include "frontends/p4/methodInstance.h"
+
+namespace WP4 {
+
+void FindDirtyFields::written(const IR::Expression* expression) {
+    // writing part of a field dirties the whole field
+    while (auto slice = expression->to<IR::Slice>())
+        expression = slice->e0;
+    if (auto member = expression->to<IR::Member>()) {
+        auto baseType = typeMap->getType(member->expr, true);
+        if (auto ht = baseType->to<IR::Type_Header>()) {
+            if (ht->getField(member->member) != nullptr)
+                dirty->addField(ht->name.name, member->member.name);
+            return;
+        }
+    }
+    dirty->addType(typeMap->getType(expression, true));
+}
+
+bool FindDirtyFields::preorder(const IR::AssignmentStatement* statement) {
+    written(statement->left);
+    return true;
+}
+
+bool FindDirtyFields::preorder(const IR::MethodCallExpression* expression) {
+    auto mi = P4::MethodInstance::resolve(expression, refMap, typeMap);
+    if (auto em = mi->to<P4::ExternMethod>()) {
+        auto& p4lib = P4::P4CoreLibrary::instance;
+        // the packet is the source of the extracted values
+        if (em->originalExternType->name.name == p4lib.packetIn.name)
+            return false;
+    }
+    for (auto p : *mi->substitution.getParametersInArgumentOrder()) {
+        if (p->direction != IR::Direction::Out && p->direction != IR::Direction::InOut)
+            continue;
+        auto arg = mi->substitution.lookup(p);
+        if (arg != nullptr)
+            written(arg->expression);
+    }
+    return true;
+}
+
+}  // namespace WP4
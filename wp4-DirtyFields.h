@@ -0,0 +1,53 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_WP4_DIRTYFIELDS_H_
+#define _BACKENDS_WP4_DIRTYFIELDS_H_
+
+#include "ir/ir.h"
+#include "frontends/p4/typeMap.h"
+#include "frontends/common/resolveReferences/referenceMap.h"
+#include "wp4-DeadFields.h"
+
+namespace WP4 {
+
+/**
+  Collects the header fields that may be written after they have been
+  extracted: assignment targets and out/inout arguments, in the parser and
+  in the control.  Extracting a header does not make its fields dirty.
+  Fields not in the set still hold the bytes they were extracted from, so
+  the deparser does not have to write them back to a header that is
+  emitted where it was extracted.
+*/
+class FindDirtyFields : public Inspector {
+    P4::ReferenceMap* refMap;
+    P4::TypeMap*      typeMap;
+    FieldSet*         dirty;
+
+    void written(const IR::Expression* expression);
+
+ public:
+    FindDirtyFields(P4::ReferenceMap* refMap, P4::TypeMap* typeMap, FieldSet* dirty) :
+            refMap(refMap), typeMap(typeMap), dirty(dirty)
+    { CHECK_NULL(refMap); CHECK_NULL(typeMap); CHECK_NULL(dirty); setName("FindDirtyFields"); }
+
+    bool preorder(const IR::AssignmentStatement* statement) override;
+    bool preorder(const IR::MethodCallExpression* expression) override;
+};
+
+}  // namespace WP4
+
+#endif  /* _BACKENDS_WP4_DIRTYFIELDS_H_ */
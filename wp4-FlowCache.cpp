@@ -0,0 +1,359 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#include "wp4-FlowCache.h"
+#include "wp4-Control.h"
+#include "wp4-Parser.h"
+#include "wp4-Type.h"
+#include "wp4-DeadFields.h"
+#include "lib/error.h"
+#include "frontends/p4/methodInstance.h"
+
+namespace WP4 {
+
+bool FlowCacheFields::cPath(const IR::Expression* expression, cstring& path, bool& isInput) const {
+    if (auto member = expression->to<IR::Member>()) {
+        if (!cPath(member->expr, path, isInput))
+            return false;
+        path = path + "." + member->member.name;
+        return true;
+    }
+    auto pe = expression->to<IR::PathExpression>();
+    if (pe == nullptr)
+        return false;
+    auto param = program->refMap->getDeclaration(pe->path, true)->to<IR::Parameter>();
+    if (param == nullptr)
+        return false;
+    if (param == control->headers) {
+        path = program->parser->headers->name.name;
+        isInput = true;
+    } else if (param == control->inputMeta) {
+        path = param->name.name;
+        isInput = true;
+    } else if (param == control->outputMeta) {
+        path = param->name.name;
+        isInput = false;
+    } else {
+        // action parameters come from the table entry
+        return false;
+    }
+    return true;
+}
+
+void FlowCacheFields::addLeaves(std::map<cstring, const IR::Type*>& set, cstring path,
+                                const IR::Type* type) {
+    if (auto ht = type->to<IR::Type_Header>()) {
+        set.emplace(path + ".wp4_valid", IR::Type_Boolean::get());
+        for (auto f : ht->fields) {
+            if (!EliminateDeadFields::isDead(f))
+                set.emplace(path + "." + f->name.name, program->typeMap->getTypeType(f->type, true));
+        }
+    } else if (auto st = type->to<IR::Type_StructLike>()) {
+        for (auto f : st->fields)
+            addLeaves(set, path + "." + f->name.name, program->typeMap->getTypeType(f->type, true));
+    } else if (type->is<IR::Type_Stack>()) {
+        ineligible = "header stacks are not supported";
+    } else {
+        set.emplace(path, type);
+    }
+}
+
+void FlowCacheFields::read(const IR::Expression* expression) {
+    cstring path;
+    bool isInput = false;
+    if (!cPath(expression, path, isInput)) {
+        visit(expression);
+        return;
+    }
+    if (isInput)
+        addLeaves(reads, path, program->typeMap->getType(expression, true));
+}
+
+void FlowCacheFields::written(const IR::Expression* expression) {
+    if (auto slice = expression->to<IR::Slice>()) {
+        // the other bits of the field are kept
+        read(slice->e0);
+        written(slice->e0);
+        return;
+    }
+    cstring path;
+    bool isInput = false;
+    if (cPath(expression, path, isInput))
+        addLeaves(writes, path, program->typeMap->getType(expression, true));
+    else
+        visit(expression);  // control locals die with the pipeline
+}
+
+bool FlowCacheFields::preorder(const IR::AssignmentStatement* statement) {
+    written(statement->left);
+    read(statement->right);
+    return false;
+}
+
+bool FlowCacheFields::preorder(const IR::MethodCallExpression* expression) {
+    auto mi = P4::MethodInstance::resolve(expression, program->refMap, program->typeMap);
+    if (auto bim = mi->to<P4::BuiltInMethod>()) {
+        cstring path;
+        bool isInput = false;
+        if (!cPath(bim->appliedTo, path, isInput)) {
+            visit(bim->appliedTo);
+            return false;
+        }
+        auto valid = path + ".wp4_valid";
+        if (bim->name == IR::Type_Header::isValid) {
+            if (isInput)
+                reads.emplace(valid, IR::Type_Boolean::get());
+        } else {
+            writes.emplace(valid, IR::Type_Boolean::get());
+        }
+        return false;
+    }
+    // table keys and action bodies are visited with the control locals
+    if (mi->is<P4::ApplyMethod>() || mi->is<P4::ActionCall>())
+        return false;
+    if (auto em = mi->to<P4::ExternMethod>()) {
+        ineligible = cstring("it uses the ") + em->originalExternType->name.name + " extern";
+        return false;
+    }
+    if (auto ef = mi->to<P4::ExternFunction>()) {
+        if (ef->method->name.name == program->model.fcs_update.name) {
+            setsFcsUpdate = true;
+            return false;
+        }
+    }
+    for (auto p : *mi->substitution.getParametersInArgumentOrder()) {
+        auto arg = mi->substitution.lookup(p);
+        if (arg == nullptr)
+            continue;
+        if (p->direction != IR::Direction::Out)
+            read(arg->expression);
+        if (p->direction == IR::Direction::Out || p->direction == IR::Direction::InOut)
+            written(arg->expression);
+    }
+    return false;
+}
+
+bool FlowCacheFields::preorder(const IR::Member* expression) {
+    cstring path;
+    bool isInput = false;
+    if (!cPath(expression, path, isInput))
+        return true;
+    read(expression);
+    return false;
+}
+
+bool FlowCacheFields::preorder(const IR::PathExpression* expression) {
+    cstring path;
+    bool isInput = false;
+    if (cPath(expression, path, isInput))
+        read(expression);
+    return false;
+}
+
+bool FlowCacheFields::preorder(const IR::ArrayIndex*) {
+    ineligible = "header stacks are not supported";
+    return false;
+}
+
+/////////////////////////////////////////////////////////////////
+
+WP4FlowCache::WP4FlowCache(const WP4Program* program, unsigned size) :
+        program(program), size(size), fields(program, program->control) {
+    keyType = WP4Model::reserved("flow_key");
+    entryType = WP4Model::reserved("flow_entry");
+    cacheName = WP4Model::reserved("flow_cache");
+    generationName = WP4Model::reserved("flow_generation");
+    keyVar = WP4Model::reserved("flowKey");
+    entryVar = WP4Model::reserved("flowEntry");
+    generationVar = WP4Model::reserved("flowGeneration");
+}
+
+bool WP4FlowCache::build() {
+    auto control = program->control;
+    control->controlBlock->container->apply(fields);
+    for (auto it : control->tables) {
+        // these count or police every lookup, or depend on the time
+        if (it.second->hasFlowField() || it.second->idleTimeout != 0)
+            fields.ineligible = cstring("table ") + it.second->instanceName +
+                                " has a direct counter, meter or idle timeout";
+    }
+    if (program->profile->instrument)
+        fields.ineligible = "the pipeline is instrumented for profiling";
+    if (!fields.ineligible.isNullOrEmpty()) {
+        ::warning(ErrorType::WARN_UNSUPPORTED, "%1%: no flow cache, because %2%",
+                  control->controlBlock->container, fields.ineligible);
+        return false;
+    }
+
+    unsigned index = 0;
+    for (auto r : fields.reads)
+        keyFields.push_back({ cstring("k") + Util::toString(index++), r.first, r.second });
+    index = 0;
+    for (auto w : fields.writes)
+        outcomeFields.push_back({ cstring("o") + Util::toString(index++), w.first, w.second });
+    return true;
+}
+
+void WP4FlowCache::emitCopy(CodeBuilder* builder, cstring dst, cstring src, const IR::Type* type) {
+    builder->emitIndent();
+    auto bits = type->to<IR::Type_Bits>();
+    if (bits != nullptr && !WP4ScalarType::generatesScalar(bits->size))
+        builder->appendFormat("memcpy(&%s, &%s, sizeof(%s));", dst.c_str(), src.c_str(), dst.c_str());
+    else
+        builder->appendFormat("%s = %s;", dst.c_str(), src.c_str());
+    builder->newline();
+}
+
+void WP4FlowCache::emitTypes(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->appendFormat("struct %s ", keyType.c_str());
+    builder->blockStart();
+    for (auto f : keyFields) {
+        builder->emitIndent();
+        WP4TypeFactory::instance->create(f.type)->declare(builder, f.member, false);
+        builder->endOfStatement(true);
+    }
+    if (keyFields.empty()) {
+        builder->emitIndent();
+        builder->appendLine("u8 none;");
+    }
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+
+    builder->emitIndent();
+    builder->appendFormat("struct %s ", entryType.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendLine("u32 generation;");
+    builder->emitIndent();
+    builder->appendFormat("struct %s key;", keyType.c_str());
+    builder->newline();
+    for (auto f : outcomeFields) {
+        builder->emitIndent();
+        WP4TypeFactory::instance->create(f.type)->declare(builder, f.member, false);
+        builder->endOfStatement(true);
+    }
+    if (fields.setsFcsUpdate) {
+        builder->emitIndent();
+        builder->appendLine("u8 fcs_update;");
+    }
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+
+    builder->appendFormat("static struct %s __percpu *%s;", entryType.c_str(), cacheName.c_str());
+    builder->newline();
+    // generation 0 is never current, so zeroed entries are invalid
+    builder->appendFormat("static atomic_t %s = ATOMIC_INIT(1);", generationName.c_str());
+    builder->newline();
+    builder->newline();
+    builder->appendLine("/* Called by the control plane after it changes any table */");
+    builder->append("void wp4_flow_cache_invalidate(void) ");
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("atomic_inc(&%s);", generationName.c_str());
+    builder->newline();
+    builder->blockEnd(true);
+    builder->appendLine("EXPORT_SYMBOL(wp4_flow_cache_invalidate);");
+    builder->newline();
+}
+
+void WP4FlowCache::emitLocalVariables(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->appendFormat("struct %s %s;", keyType.c_str(), keyVar.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("struct %s *%s = NULL;", entryType.c_str(), entryVar.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("u32 %s = 0;", generationVar.c_str());
+    builder->newline();
+}
+
+void WP4FlowCache::emitLookup(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->appendLine("/* flow cache */");
+    builder->emitIndent();
+    builder->appendFormat("memset(&%s, 0, sizeof(%s));", keyVar.c_str(), keyVar.c_str());
+    builder->newline();
+    for (auto f : keyFields)
+        emitCopy(builder, keyVar + "." + f.member, f.path, f.type);
+    builder->emitIndent();
+    builder->appendFormat("%s = atomic_read(&%s);", generationVar.c_str(), generationName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("%s = this_cpu_ptr(%s) + (jhash(&%s, sizeof(%s), 0) & %u);",
+                          entryVar.c_str(), cacheName.c_str(), keyVar.c_str(), keyVar.c_str(),
+                          size - 1);
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("if (likely(%s->generation == %s && wp4_key_equal(&%s->key, &%s, sizeof(%s)))) ",
+                          entryVar.c_str(), generationVar.c_str(), entryVar.c_str(),
+                          keyVar.c_str(), keyVar.c_str());
+    builder->blockStart();
+    for (auto f : outcomeFields)
+        emitCopy(builder, f.path, entryVar + "->" + f.member, f.type);
+    if (fields.setsFcsUpdate) {
+        builder->emitIndent();
+        builder->appendFormat("%s = %s->fcs_update;", program->fcsUpdateVar.c_str(), entryVar.c_str());
+        builder->newline();
+    }
+    builder->emitIndent();
+    builder->appendFormat("%s = NULL;", entryVar.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("goto %s;", program->endLabel.c_str());
+    builder->newline();
+    builder->blockEnd(true);
+}
+
+void WP4FlowCache::emitFill(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->appendFormat("if (%s != NULL) ", entryVar.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("%s->generation = %s;", entryVar.c_str(), generationVar.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("%s->key = %s;", entryVar.c_str(), keyVar.c_str());
+    builder->newline();
+    for (auto f : outcomeFields)
+        emitCopy(builder, entryVar + "->" + f.member, f.path, f.type);
+    if (fields.setsFcsUpdate) {
+        builder->emitIndent();
+        builder->appendFormat("%s->fcs_update = %s;", entryVar.c_str(), program->fcsUpdateVar.c_str());
+        builder->newline();
+    }
+    builder->blockEnd(true);
+}
+
+void WP4FlowCache::emitAllocation(CodeBuilder* builder, cstring failLabel) {
+    builder->emitIndent();
+    builder->appendFormat("%s = __alloc_percpu(%u * sizeof(struct %s), __alignof__(struct %s));",
+                          cacheName.c_str(), size, entryType.c_str(), entryType.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("if (!%s) goto %s;", cacheName.c_str(), failLabel.c_str());
+    builder->newline();
+}
+
+void WP4FlowCache::emitFree(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->appendFormat("free_percpu(%s);", cacheName.c_str());
+    builder->newline();
+}
+
+}  // namespace WP4
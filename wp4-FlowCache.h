@@ -0,0 +1,97 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#ifndef _BACKENDS_WP4_WP4FLOWCACHE_H_
+#define _BACKENDS_WP4_WP4FLOWCACHE_H_
+
+#include "wp4-Object.h"
+#include "wp4-Program.h"
+
+namespace WP4 {
+
+class WP4Control;
+
+/**
+  Collects the fields that the switch control reads and writes, as C
+  lvalues of the generated program.  Reads are limited to the headers and
+  the input metadata: the output metadata and the control locals are not
+  inputs of the pipeline.  Constructs whose outcome does not depend only on
+  these fields make the control ineligible for caching.
+*/
+class FlowCacheFields : public Inspector {
+    const WP4Program* program;
+    const WP4Control* control;
+
+    bool cPath(const IR::Expression* expression, cstring& path, bool& isInput) const;
+    void addLeaves(std::map<cstring, const IR::Type*>& set, cstring path, const IR::Type* type);
+    void read(const IR::Expression* expression);
+    void written(const IR::Expression* expression);
+
+ public:
+    // C lvalue -> P4 type
+    std::map<cstring, const IR::Type*> reads;
+    std::map<cstring, const IR::Type*> writes;
+    bool setsFcsUpdate = false;
+    cstring ineligible;  // reason, empty if the control can be cached
+
+    FlowCacheFields(const WP4Program* program, const WP4Control* control) :
+            program(program), control(control)
+    { setName("FlowCacheFields"); }
+
+    bool preorder(const IR::AssignmentStatement* statement) override;
+    bool preorder(const IR::MethodCallExpression* expression) override;
+    bool preorder(const IR::Member* expression) override;
+    bool preorder(const IR::PathExpression* expression) override;
+    bool preorder(const IR::ArrayIndex* expression) override;
+};
+
+// An exact-match cache of the outcome of the switch control, in front of
+// it.  The key holds every field the control reads; an entry holds the
+// values of every field it writes.  Each CPU has its own direct-mapped
+// cache, and all entries are invalidated at once by bumping a generation
+// number whenever the control plane changes a table.
+class WP4FlowCache : public WP4Object {
+    const WP4Program* program;
+    unsigned          size;  // entries per CPU, a power of 2
+    FlowCacheFields   fields;
+    struct Field {
+        cstring member;  // in the key or entry
+        cstring path;    // in the program
+        const IR::Type* type;
+    };
+    std::vector<Field> keyFields;
+    std::vector<Field> outcomeFields;
+
+    cstring keyType, entryType, cacheName, generationName;
+    cstring keyVar, entryVar, generationVar;
+
+    void emitCopy(CodeBuilder* builder, cstring dst, cstring src, const IR::Type* type);
+
+ public:
+    WP4FlowCache(const WP4Program* program, unsigned size);
+    bool build();  // false if the control cannot be cached
+    void emitTypes(CodeBuilder* builder);
+    void emitLocalVariables(CodeBuilder* builder);
+    void emitLookup(CodeBuilder* builder);  // at the start of the pipeline
+    void emitFill(CodeBuilder* builder);    // at the end of the pipeline
+    void emitAllocation(CodeBuilder* builder, cstring failLabel);
+    void emitFree(CodeBuilder* builder);
+};
+
+}  // namespace WP4
+
+#endif /* _BACKENDS_WP4_WP4FLOWCACHE_H_ */
@@ -21,6 +21,15 @@ namespace WP4 {
 const IR::Expression* LowerExpressions::shift(const IR::Operation_Binary* expression) const {
     auto rhs = expression->right;
     auto rhstype = typeMap->getType(rhs, true);
+    auto ltype = typeMap->getType(getOriginal(), true);
+    auto lbits = ltype->to<IR::Type_Bits>();
+    if (lbits != nullptr && lbits->size > 64) {
+        // wide values are shifted by the runtime, limb by limb
+        if (!rhs->is<IR::Constant>())
+            ::error("%1%: shifts on %2% bits must be by a constant", expression, lbits->size);
+        typeMap->setType(expression, ltype);
+        return expression;
+    }
     if (rhstype->is<IR::Type_InfInt>()) {
         auto cst = rhs->to<IR::Constant>();
         big_int maxShift = Util::shift_left(1, LowerExpressions::maxShiftWidth);
@@ -33,7 +42,6 @@ const IR::Expression* LowerExpressions::shift(const IR::Operation_Binary* expres
             ::error("%1%: shift amount limited to %2% bits on this target",
                     expression, LowerExpressions::maxShiftWidth);
     }
-    auto ltype = typeMap->getType(getOriginal(), true);
     typeMap->setType(expression, ltype);
     return expression;
 }
@@ -0,0 +1,93 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#include "wp4-Meter.h"
+#include "lib/error.h"
+
+namespace WP4 {
+
+WP4Meter::WP4Meter(const WP4Program* program, const IR::ExternBlock* block, bool isDirect) :
+        program(program), block(block), isDirect(isDirect) {
+    auto di = block->node->to<IR::Declaration_Instance>();
+    BUG_CHECK(di != nullptr, "%1%: expected an instance", block->node);
+    instanceName = WP4Object::externalName(di);
+    setName = instanceName + "_set";
+
+    if (isDirect) {
+        // buckets indexed by the wp4_flow of the entry
+        size = "MAX_FLOWS";
+        return;
+    }
+    auto sz = block->getParameterValue(program->model.meter.size.name)->to<IR::Constant>();
+    if (sz == nullptr || sz->value <= 0) {
+        ::error("%1%: meter size must be a positive constant", di);
+        return;
+    }
+    size = Util::toString(sz->asUnsigned());
+}
+
+void WP4Meter::emitInstance(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->appendFormat("static struct wp4_meter %s[%s];", instanceName.c_str(), size.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("static struct wp4_meter_set %s = { .meters = %s, .size = %s };",
+                          setName.c_str(), instanceName.c_str(), size.c_str());
+    builder->newline();
+}
+
+void WP4Meter::emitAllocation(CodeBuilder* builder, cstring dirName) {
+    builder->emitIndent();
+    builder->appendFormat("debugfs_create_file(\"%s\", 0200, %s, &%s, &wp4_meter_fops);",
+                          instanceName.c_str(), dirName.c_str(), setName.c_str());
+    builder->newline();
+}
+
+void WP4Meter::emitMethodInvocation(CodeBuilder* builder, const P4::ExternMethod* method,
+                                    CodeGenInspector* codeGen, cstring entryIndex) {
+    auto args = method->expr->arguments;
+    BUG_CHECK(method->method->name.name == program->model.meter.execute.name,
+              "%1%: unexpected meter method", method->expr);
+    if (isDirect && entryIndex.isNullOrEmpty()) {
+        ::error("%1%: a direct meter can only be executed by the actions of its table",
+                method->expr);
+        return;
+    }
+
+    // the remaining arguments follow the index of an indexed meter
+    size_t arg = 0;
+    builder->append("(");
+    if (isDirect)
+        builder->append(entryIndex);
+    else
+        codeGen->emitMasked(args->at(arg++)->expression);
+    builder->appendFormat(" < %s ? wp4_meter_execute(&%s[", size.c_str(), instanceName.c_str());
+    if (isDirect)
+        builder->append(entryIndex);
+    else
+        codeGen->emitMasked(args->at(0)->expression);
+    builder->append("], ");
+    codeGen->emitMasked(args->at(arg++)->expression);
+    builder->append(", ");
+    if (arg < args->size())
+        codeGen->emitMasked(args->at(arg)->expression);
+    else
+        builder->append("wp4_meter_now()");
+    builder->append(") : WP4_METER_GREEN)");
+}
+
+}  // namespace WP4
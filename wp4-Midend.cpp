@@ -42,10 +42,10 @@ limitations under the License.
 #include "midend/simplifyKey.h"
 #include "midend/simplifySelectCases.h"
 #include "midend/simplifySelectList.h"
-#include "midend/singleArgumentSelect.h"
 #include "midend/tableHit.h"
 #include "midend/validateProperties.h"
 #include "wp4-Lower.h"
+#include "wp4-DeadFields.h"
 
 namespace WP4 {
 
@@ -95,11 +95,13 @@ const IR::ToplevelBlock* MidEnd::run(WP4Options& options, const IR::P4Program* p
                 new P4::SimplifySelectList(&refMap, &typeMap),
                 new P4::MoveDeclarations(),  // more may have been introduced
                 new P4::RemoveSelectBooleans(&refMap, &typeMap),
-                new P4::SingleArgumentSelect(),
                 new P4::ConstantFolding(&refMap, &typeMap),
+                // constant folding may turn selects into plain transitions
+                new P4::SimplifyParsers(&refMap),
                 new P4::SimplifyControlFlow(&refMap, &typeMap),
                 new P4::TableHit(&refMap, &typeMap),
                 new P4::RemoveLeftSlices(&refMap, &typeMap),
+                new WP4::EliminateDeadFields(&refMap, &typeMap),
                 new WP4::Lower(&refMap, &typeMap),
                 evaluator,
                 new P4::MidEndLast()
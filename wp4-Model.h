@@ -31,6 +31,57 @@ struct TableImpl_Model : public ::Model::Extern_Model {
     ::Model::Elem size;
 };
 
+struct Register_Model : public ::Model::Extern_Model {
+    Register_Model() : Extern_Model("register"),
+                       size("size"), read("read"), write("write"), add("add"),
+                       perCpu("per_cpu"), atomic("atomic") {}
+    ::Model::Elem size;
+    ::Model::Elem read;
+    ::Model::Elem write;
+    ::Model::Elem add;
+    // annotations selecting the storage
+    ::Model::Elem perCpu;
+    ::Model::Elem atomic;
+};
+
+struct CounterType_Model : public ::Model::Enum_Model {
+    CounterType_Model() : ::Model::Enum_Model("CounterType"),
+                          packets("packets"), bytes("bytes"),
+                          packets_and_bytes("packets_and_bytes") {}
+    ::Model::Elem packets;
+    ::Model::Elem bytes;
+    ::Model::Elem packets_and_bytes;
+};
+
+struct Counter_Model : public ::Model::Extern_Model {
+    Counter_Model() : Extern_Model("counter"),
+                      size("size"), type("type"), count("count") {}
+    ::Model::Elem size;
+    ::Model::Elem type;
+    ::Model::Elem count;
+};
+
+struct DirectCounter_Model : public ::Model::Extern_Model {
+    DirectCounter_Model() : Extern_Model("direct_counter"),
+                            type("type"), counters("counters") {}
+    ::Model::Elem type;
+    // table property naming the direct counter of the table
+    ::Model::Elem counters;
+};
+
+struct Meter_Model : public ::Model::Extern_Model {
+    Meter_Model() : Extern_Model("meter"), size("size"), execute("execute") {}
+    ::Model::Elem size;
+    ::Model::Elem execute;
+};
+
+struct DirectMeter_Model : public ::Model::Extern_Model {
+    DirectMeter_Model() : Extern_Model("direct_meter"), execute("execute"), meters("meters") {}
+    ::Model::Elem execute;
+    // table property naming the direct meter of the table
+    ::Model::Elem meters;
+};
+
 struct Switch_Model : public ::Model::Elem {
     Switch_Model() : Elem("wp4"),
                      wp4_parser("prs"), wp4_switch("swtch"), wp4_deparser("deprs") {}
@@ -41,41 +92,65 @@ struct Switch_Model : public ::Model::Elem {
 
 struct InputMetadataModel : public ::Model::Type_Model {
     InputMetadataModel() : ::Model::Type_Model("wp4_input"),
-        inputPort("input_port"), inputPortType(IR::Type_Bits::get(32))
+        inputPort("input_port"), inputPortType(IR::Type_Bits::get(32)),
+        rssi("rssi"), rate("rate"), channelFreq("channel_freq"),
+        channelFlags("channel_flags"), timestamp("timestamp")
     {}
 
     ::Model::Elem inputPort;
     const IR::Type* inputPortType;
+    // filled from the radiotap header, named as in struct wp4_radiotap
+    ::Model::Elem rssi;
+    ::Model::Elem rate;
+    ::Model::Elem channelFreq;
+    ::Model::Elem channelFlags;
+    ::Model::Elem timestamp;
 };
 
 struct OutputMetadataModel : public ::Model::Type_Model {
     OutputMetadataModel() : ::Model::Type_Model("wp4_output"),
             outputPort("output_port"), outputPortType(IR::Type_Bits::get(32)),
-                            output_action("output_action")
+                            output_action("output_action"),
+            outputPorts("output_ports"), queue("queue"), drop("drop"), ac("ac")
     {}
 
     ::Model::Elem outputPort;
     const IR::Type* outputPortType;
     ::Model::Elem output_action;
+    ::Model::Elem outputPorts;
+    ::Model::Elem queue;
+    ::Model::Elem drop;
+    ::Model::Elem ac;
 };
 
 // Keep this in sync with wp4_model.p4
 class WP4Model : public ::Model::Model {
  protected:
     WP4Model() : Model("0.1"),
-                  hash_table("hash_table"),
+                  hash_table("hash_table"), cuckoo_hash_table("cuckoo_hash_table"), register_(),
+                  counterType(), counter(), directCounter(), meter(), directMeter(),
                   tableImplProperty("implementation"),
+                  idleTimeoutProperty("idle_timeout"),
                   CPacketName("p_uc_data"),
                   packet("packet", P4::P4CoreLibrary::instance.packetIn, 0),
                   inputMetadataModel(), outputMetadataModel(),
-                  wp4_switch(), counterIndexType("u32"), counterValueType("u32")
+                  wp4_switch(), counterIndexType("u32"), counterValueType("u32"),
+                  csum16_update("csum16_update"), fcs_update("fcs_update")
     {}
 
  public:
     static WP4Model instance;
     static cstring reservedPrefix;
     TableImpl_Model        hash_table;
+    TableImpl_Model        cuckoo_hash_table;
+    Register_Model         register_;
+    CounterType_Model      counterType;
+    Counter_Model          counter;
+    DirectCounter_Model    directCounter;
+    Meter_Model            meter;
+    DirectMeter_Model      directMeter;
     ::Model::Elem          tableImplProperty;
+    ::Model::Elem          idleTimeoutProperty;
     ::Model::Elem          CPacketName;
     ::Model::Param_Model   packet;
     InputMetadataModel inputMetadataModel;
@@ -83,6 +158,8 @@ class WP4Model : public ::Model::Model {
     Switch_Model           wp4_switch;
     cstring counterIndexType;
     cstring counterValueType;
+    ::Model::Elem          csum16_update;
+    ::Model::Elem          fcs_update;
 
     static cstring reserved(cstring name)
     { return reservedPrefix + name; }
@@ -16,6 +16,7 @@ limitations under the License.
 #define _BACKENDS_WP4_OPTIONS_H_
 
 #include <getopt.h>
+#include <cstdlib>
 #include "frontends/common/options.h"
 
 class WP4Options : public CompilerOptions {
@@ -25,6 +26,18 @@ class WP4Options : public CompilerOptions {
     bool parseOnly = false;
     bool validateOnly = false;
     bool loadIRFromJson = false;
+    // set together with loadIRFromJson: the snapshot skips the same passes
+    bool loadIRFromBinary = false;
+    cstring dumpBinaryIRFile = nullptr;
+    // count branches in the generated code
+    bool profileGenerate = false;
+    cstring profileUseFile = nullptr;
+    // entries per CPU of the flow cache, 0 if there is none
+    unsigned flowCacheSize = 0;
+    // frames start with a radiotap header
+    bool radiotap = false;
+    // queue frames per access category before the driver
+    bool egressScheduler = false;
     WP4Options() {
         langVersion = CompilerOptions::FrontendVersion::P4_16;
         registerOption("-o", "outfile",
@@ -48,6 +61,44 @@ class WP4Options : public CompilerOptions {
                            return true;
                        },
                        "read previously dumped json instead of P4 source code");
+        registerOption("--fromBinaryIR", "file",
+                       [this](const char* arg) {
+                           loadIRFromJson = true;
+                           loadIRFromBinary = true;
+                           file = arg;
+                           return true;
+                       },
+                       "read previously dumped binary IR instead of P4 source code");
+        registerOption("--toBinaryIR", "file",
+                       [this](const char* arg) { dumpBinaryIRFile = arg; return true; },
+                       "dump the IR after the front-end to file in binary form");
+        registerOption("--profile-gen", nullptr,
+                       [this](const char*) { profileGenerate = true; return true; },
+                       "instrument the generated code to count parser transitions, "
+                       "table hits and misses and actions");
+        registerOption("--profile-use", "file",
+                       [this](const char* arg) { profileUseFile = arg; return true; },
+                       "lay out the generated code using the counts reported by "
+                       "an instrumented module");
+        registerOption("--flow-cache", "entries",
+                       [this](const char* arg) {
+                           char* end;
+                           unsigned long entries = strtoul(arg, &end, 0);
+                           if (*end != '\0' || entries == 0 || (entries & (entries - 1)) != 0 ||
+                               entries > (1UL << 20))
+                               return false;
+                           flowCacheSize = entries;
+                           return true; },
+                       "cache the outcome of the switch control for each flow, in a "
+                       "per-CPU table of this many entries (a power of 2, at most 2^20)");
+        registerOption("--radiotap", nullptr,
+                       [this](const char*) { radiotap = true; return true; },
+                       "decode the radiotap header that starts every frame into "
+                       "wp4_input and strip it before the parser");
+        registerOption("--egress-scheduler", nullptr,
+                       [this](const char*) { egressScheduler = true; return true; },
+                       "queue frames per WMM access category (wp4_output.ac) and hand "
+                       "them to the driver in deficit round robin order");
      }
 };
 
@@ -14,30 +14,74 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+
 #include "wp4-Model.h"
 #include "wp4-Parser.h"
 #include "wp4-Type.h"
+#include "wp4-DeadFields.h"
 #include "frontends/p4/coreLibrary.h"
 #include "frontends/p4/methodInstance.h"
 
 namespace WP4 {
 
 namespace {
+// One case of a select expression over the concatenated key
+struct SelectCaseKey {
+    // a field of the key that has to lie within [low, high]
+    struct Range {
+        unsigned shift;
+        uint64_t mask;
+        uint64_t low, high;
+    };
+
+    uint64_t value = 0;
+    uint64_t mask = 0;
+    std::vector<Range> ranges;
+    const IR::ParserState* target = nullptr;
+
+    bool isDefault() const { return mask == 0 && ranges.empty(); }
+};
+
 class StateTranslationVisitor : public CodeGenInspector {
-    bool hasDefault;
     P4::P4CoreLibrary& p4lib;
     const WP4ParserState* state;
+    int entryOffset;
+    // Current packet offset in bits in a state specialized for a constant
+    // entry offset; -1 if the offset variable has to be used.
+    int constOffset;
+
+    cstring byteOffset() const;
+    void advance(unsigned width);
+    void advance(cstring width);
+    void emitJump(cstring target, cstring label, bool storeOffset);
+    uint64_t edgeCount(const IR::ParserState* target) const;
+    cstring hinted(cstring condition, uint64_t taken, uint64_t notTaken) const;
+    void emitGoto(cstring builtin);
+    void emitGoto(const IR::ParserState* target);
+    void emitGoto(const IR::Expression* target);
+    const IR::ParserState* getTarget(const IR::Expression* target) const;
+
+    bool addKeyset(SelectCaseKey* key, const IR::Expression* keyset, unsigned shift, unsigned width);
+    void emitSelectChain(const std::vector<SelectCaseKey>& cases, const IR::ParserState* fallback);
+    void emitSelectBitmaps(const std::vector<std::pair<uint64_t, const IR::ParserState*>>& values);
+    void emitSelectSwitch(const std::vector<std::pair<uint64_t, const IR::ParserState*>>& values);
+    void emitSelectSearch(const std::vector<std::pair<uint64_t, const IR::ParserState*>>& values,
+                          size_t low, size_t high, const IR::ParserState* fallback);
 
     void compileExtractField(const IR::Expression* expr, cstring name, unsigned alignment, WP4Type* type);
-    void compileExtract(const IR::Expression* destination);
+    void compileExtract(const IR::Expression* destination, const IR::Expression* length = nullptr);
+    void emitPeek(unsigned position, unsigned width, WP4Type* type);
     void compileLookahead(const IR::Expression* destination);
 
  public:
-    explicit StateTranslationVisitor(const WP4ParserState* state) :
+    StateTranslationVisitor(const WP4ParserState* state, int entryOffset) :
             CodeGenInspector(state->parser->program->refMap, state->parser->program->typeMap),
-            hasDefault(false), p4lib(P4::P4CoreLibrary::instance), state(state) {}
+            p4lib(P4::P4CoreLibrary::instance), state(state),
+            entryOffset(entryOffset), constOffset(entryOffset) {}
     bool preorder(const IR::ParserState* state) override;
-    bool preorder(const IR::SelectCase* selectCase) override;
     bool preorder(const IR::SelectExpression* expression) override;
     bool preorder(const IR::Member* expression) override;
     bool preorder(const IR::MethodCallExpression* expression) override;
@@ -47,18 +91,211 @@ class StateTranslationVisitor : public CodeGenInspector {
 };
 }  // namespace
 
+cstring StateTranslationVisitor::byteOffset() const {
+    if (constOffset >= 0)
+        return Util::toString(constOffset / 8);
+    return cstring("BYTES(") + state->parser->program->offsetVar + ")";
+}
+
+void StateTranslationVisitor::advance(unsigned width) {
+    if (constOffset >= 0) {
+        constOffset += width;
+        return;
+    }
+    builder->emitIndent();
+    builder->appendFormat("%s += %d", state->parser->program->offsetVar.c_str(), width);
+    builder->endOfStatement(true);
+}
+
+// A run-time amount; only in states that use the offset variable
+void StateTranslationVisitor::advance(cstring width) {
+    BUG_CHECK(constOffset < 0, "%1%: variable advance at a constant offset", state->state);
+    builder->emitIndent();
+    builder->appendFormat("%s += %s", state->parser->program->offsetVar.c_str(), width.c_str());
+    builder->endOfStatement(true);
+}
+
+// Emits a single statement, so that it can follow a case label or an if.
+void StateTranslationVisitor::emitJump(cstring target, cstring label, bool storeOffset) {
+    auto program = state->parser->program;
+    cstring count = program->profile->increment(WP4Profile::transition(state->state->name.name, target));
+    if (!storeOffset && count.isNullOrEmpty()) {
+        builder->appendFormat("goto %s;", label.c_str());
+        return;
+    }
+    builder->append("{ ");
+    if (!count.isNullOrEmpty())
+        builder->appendFormat("%s ", count.c_str());
+    if (storeOffset)
+        builder->appendFormat("%s = %d; ", program->offsetVar.c_str(), constOffset);
+    builder->appendFormat("goto %s; }", label.c_str());
+}
+
+void StateTranslationVisitor::emitGoto(cstring builtin) {
+    // Code after the parser reads the offset variable
+    emitJump(builtin, builtin, constOffset >= 0 && builtin != IR::ParserState::reject);
+}
+
+uint64_t StateTranslationVisitor::edgeCount(const IR::ParserState* target) const {
+    cstring name = target == nullptr ? IR::ParserState::reject : target->name.name;
+    return state->parser->program->profile->count(WP4Profile::transition(state->state->name.name, name));
+}
+
+// Wraps 'condition' in the branch hint the profile suggests.
+cstring StateTranslationVisitor::hinted(cstring condition, uint64_t taken, uint64_t notTaken) const {
+    cstring hint = state->parser->program->profile->hint(taken, notTaken);
+    if (hint.isNullOrEmpty())
+        return condition;
+    return hint + "(" + condition + ")";
+}
+
+// A null target is the implicit reject of a select without default.
+void StateTranslationVisitor::emitGoto(const IR::ParserState* target) {
+    auto parser = state->parser;
+    if (target == nullptr) {
+        emitGoto(IR::ParserState::reject);
+        return;
+    }
+    if (target->isBuiltin()) {
+        emitGoto(target->name.name);
+        return;
+    }
+    // Leaving the specialized code: the target reads the offset variable
+    emitJump(target->name.name, parser->stateLabel(target, constOffset),
+             constOffset >= 0 && !parser->specialized(target, constOffset));
+}
+
+const IR::ParserState* StateTranslationVisitor::getTarget(const IR::Expression* target) const {
+    auto pe = target->to<IR::PathExpression>();
+    BUG_CHECK(pe != nullptr, "%1%: expected a state name", target);
+    auto decl = state->parser->program->refMap->getDeclaration(pe->path, true);
+    auto ps = decl->getNode()->to<IR::ParserState>();
+    BUG_CHECK(ps != nullptr, "%1%: expected a state", target);
+    return ps;
+}
+
+void StateTranslationVisitor::emitGoto(const IR::Expression* target) {
+    emitGoto(getTarget(target));
+}
+
+// Appends the width bits found position bits past the current offset,
+// read with as few big-endian loads as cover them.
+void StateTranslationVisitor::emitPeek(unsigned position, unsigned width, WP4Type* type) {
+    auto program = state->parser->program;
+    unsigned alignment = position % 8;
+    unsigned byte = position / 8;
+    unsigned bytes = (alignment + width + 7) / 8;
+    if (bytes > 8) {
+        ::error("%1%: lookahead of a field that spans more than 8 bytes", state->state);
+        return;
+    }
+
+    cstring load;
+    unsigned done = 0;
+    for (unsigned size : { 8, 4, 2, 1 }) {
+        if (bytes - done < size)
+            continue;
+        cstring ptr = program->packetStartVar + " + " + byteOffset() + " + " +
+                Util::toString(byte + done);
+        cstring part = size == 1 ? "*(" + ptr + ")" :
+                "get_unaligned_be" + Util::toString(size * 8) + "(" + ptr + ")";
+        if (done == 0)
+            load = cstring(bytes > 4 ? "(u64)" : "(u32)") + part;
+        else
+            load = "(" + load + " << " + Util::toString(size * 8) + " | " + part + ")";
+        done += size;
+    }
+    unsigned shift = bytes * 8 - alignment - width;
+    builder->appendFormat("((%s)", load.c_str());
+    if (shift != 0)
+        builder->appendFormat(" >> %d", shift);
+    builder->append(")");
+    if (width != bytes * 8) {
+        builder->append(" & WP4_MASK(");
+        type->emit(builder);
+        builder->appendFormat(", %d)", width);
+    }
+}
+
+/*
+  lookahead<T>() is a peek: one bounds check and a direct load of the
+  bits into the destination; the offset does not move.  A header is
+  filled field by field from the same bits and marked valid, as the
+  language requires, but nothing is extracted.
+*/
 void
 StateTranslationVisitor::compileLookahead(const IR::Expression* destination) {
+    auto program = state->parser->program;
+    auto type = state->parser->typeMap->getType(destination);
+    unsigned position = constOffset >= 0 ? constOffset % 8 : 0;
+    unsigned width;
+    if (auto bits = type->to<IR::Type_Bits>()) {
+        width = bits->size;
+        if (width > 64) {
+            ::error("%1%: lookahead of more than 64 bits into a scalar is not supported",
+                    destination);
+            return;
+        }
+    } else if (auto ht = type->to<IR::Type_StructLike>()) {
+        width = ht->width_bits();
+        for (auto f : ht->fields) {
+            if (!state->parser->typeMap->getType(f)->is<IR::Type_Bits>()) {
+                ::error("%1%: lookahead is only supported for fixed-width fields", f);
+                return;
+            }
+        }
+    } else {
+        ::error("%1%: unsupported lookahead type %2%", destination, type);
+        return;
+    }
+
     builder->emitIndent();
+    if (constOffset >= 0)
+        builder->appendFormat("if ((%s * 8) < %d) ",
+                              program->inPacketLengthVar.c_str(), constOffset + width);
+    else
+        builder->appendFormat("if ((%s * 8) < %s + %d) ",
+                              program->inPacketLengthVar.c_str(), program->offsetVar.c_str(), width);
     builder->blockStart();
     builder->emitIndent();
-    builder->appendFormat("%s_save = %s", state->parser->program->offsetVar.c_str(), state->parser->program->offsetVar.c_str());
-    builder->endOfStatement(true);
-    compileExtract(destination);
-    builder->emitIndent();
-    builder->appendFormat("%s = %s_save", state->parser->program->offsetVar.c_str(), state->parser->program->offsetVar.c_str());
-    builder->endOfStatement(true);
+    emitGoto(IR::ParserState::accept);
+    builder->newline();
     builder->blockEnd(true);
+
+    auto ht = type->to<IR::Type_StructLike>();
+    if (ht == nullptr) {
+        builder->emitIndent();
+        visit(destination);
+        builder->append(" = ");
+        emitPeek(position, width, WP4TypeFactory::instance->create(type));
+        builder->endOfStatement(true);
+        return;
+    }
+
+    for (auto f : ht->fields) {
+        auto ftype = state->parser->typeMap->getType(f);
+        unsigned fwidth = ftype->to<IR::Type_Bits>()->size;
+        if (!EliminateDeadFields::isDead(f)) {
+            builder->emitIndent();
+            visit(destination);
+            builder->appendFormat(".%s = ", f->name.name.c_str());
+            emitPeek(position, fwidth, WP4TypeFactory::instance->create(ftype));
+            builder->endOfStatement(true);
+        }
+        position += fwidth;
+    }
+    if (ht->is<IR::Type_Header>()) {
+        builder->emitIndent();
+        visit(destination);
+        if (constOffset >= 0)
+            builder->appendFormat(".wp4_offset = %d;", constOffset);
+        else
+            builder->appendFormat(".wp4_offset = %s;", program->offsetVar.c_str());
+        builder->newline();
+        builder->emitIndent();
+        visit(destination);
+        builder->appendLine(".wp4_valid = 1;");
+    }
 }
 
 bool StateTranslationVisitor::preorder(const IR::AssignmentStatement* statement) {
@@ -86,7 +323,7 @@ bool StateTranslationVisitor::preorder(const IR::ParserState* parserState) {
     if (parserState->isBuiltin()) return false;
 
     builder->emitIndent();
-    builder->append(parserState->name.name);
+    builder->append(state->parser->stateLabel(parserState, entryOffset));
     builder->append(":");
     builder->spc();
     builder->blockStart();
@@ -104,55 +341,307 @@ bool StateTranslationVisitor::preorder(const IR::ParserState* parserState) {
         if (!parserState->selectExpression->is<IR::PathExpression>())
             BUG("Expected a PathExpression, got a %1%", parserState->selectExpression);
         builder->emitIndent();
-        builder->append("goto ");
-        visit(parserState->selectExpression);
-        builder->endOfStatement(true);
+        emitGoto(parserState->selectExpression);
+        builder->newline();
     }
 
     builder->blockEnd(true);
     return false;
 }
 
+namespace {
+const char* selectKeyVar = "wp4_select";
+
+cstring hexConstant(uint64_t value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "0x%llxULL", static_cast<unsigned long long>(value));
+    return buf;
+}
+
+uint64_t widthMask(unsigned width) {
+    return width >= 64 ? ~0ULL : (1ULL << width) - 1;
+}
+}  // namespace
+
+// Adds the constraint of one keyset component, placed at 'shift' in the key.
+bool StateTranslationVisitor::addKeyset(
+    SelectCaseKey* key, const IR::Expression* keyset, unsigned shift, unsigned width) {
+    uint64_t fieldMask = widthMask(width);
+    if (keyset->is<IR::DefaultExpression>())
+        return true;
+    if (auto c = keyset->to<IR::Constant>()) {
+        key->value |= (c->asUint64() & fieldMask) << shift;
+        key->mask |= fieldMask << shift;
+        return true;
+    }
+    if (auto m = keyset->to<IR::Mask>()) {
+        auto value = m->left->to<IR::Constant>();
+        auto mask = m->right->to<IR::Constant>();
+        if (value == nullptr || mask == nullptr) {
+            ::error("%1%: mask must be a constant", m);
+            return false;
+        }
+        uint64_t mv = mask->asUint64() & fieldMask;
+        key->value |= (value->asUint64() & mv) << shift;
+        key->mask |= mv << shift;
+        return true;
+    }
+    if (auto r = keyset->to<IR::Range>()) {
+        auto low = r->left->to<IR::Constant>();
+        auto high = r->right->to<IR::Constant>();
+        if (low == nullptr || high == nullptr) {
+            ::error("%1%: range bounds must be constants", r);
+            return false;
+        }
+        key->ranges.push_back({ shift, fieldMask, low->asUint64(), high->asUint64() });
+        return true;
+    }
+    ::error("%1%: keyset not supported", keyset);
+    return false;
+}
+
+/*
+  All select components are concatenated into a single 64-bit key, first
+  component in the most significant bits, and every case is turned into a
+  (value, mask) pair plus optional per-field ranges.  If all cases are exact
+  matches, the cases are dispatched in the cheapest of three ways:
+  - bitmap: the values span less than 64 and go to at most two states;
+    one shift and AND per state
+  - jump table: the values are dense; a switch the C compiler turns into a
+    table lookup
+  - binary search: otherwise; an unrolled search over the sorted values.
+  Cases with masks or ranges are tested in order, since the first match wins.
+*/
 bool StateTranslationVisitor::preorder(const IR::SelectExpression* expression) {
-    hasDefault = false;
-    if (expression->select->components.size() != 1) {
-        // TODO: this does not handle correctly tuples
-        ::error("%1%: only supporting a single argument for select", expression->select);
+    auto components = expression->select->components;
+    std::vector<unsigned> widths;
+    unsigned keyWidth = 0;
+    for (auto c : components) {
+        auto type = typeMap->getType(c, true);
+        auto tb = type->to<IR::Type_Bits>();
+        if (tb == nullptr) {
+            ::error("%1%: unsupported type %2% for select", c, type);
+            return false;
+        }
+        widths.push_back(tb->size);
+        keyWidth += tb->size;
+    }
+    if (keyWidth > 64) {
+        ::error("%1%: select key wider than 64 bits is not supported", expression->select);
         return false;
     }
+
+    std::vector<SelectCaseKey> cases;
+    const IR::ParserState* fallback = nullptr;
+    bool exact = true;
+    for (auto sc : expression->selectCases) {
+        SelectCaseKey key;
+        key.target = getTarget(sc->state);
+        if (!sc->keyset->is<IR::DefaultExpression>()) {
+            std::vector<const IR::Expression*> keysets;
+            if (auto le = sc->keyset->to<IR::ListExpression>())
+                keysets.insert(keysets.end(), le->components.begin(), le->components.end());
+            else
+                keysets.push_back(sc->keyset);
+            if (keysets.size() != components.size()) {
+                ::error("%1%: keyset does not match the select key", sc->keyset);
+                return false;
+            }
+            unsigned shift = keyWidth;
+            for (size_t i = 0; i < keysets.size(); i++) {
+                shift -= widths[i];
+                if (!addKeyset(&key, keysets[i], shift, widths[i]))
+                    return false;
+            }
+        }
+        if (key.isDefault()) {
+            // later cases can never match
+            fallback = key.target;
+            break;
+        }
+        if (key.mask != widthMask(keyWidth) || !key.ranges.empty())
+            exact = false;
+        cases.push_back(key);
+    }
+
     builder->emitIndent();
-    builder->append("switch (");
-    visit(expression->select);
-    builder->append(") ");
     builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("u64 %s = ", selectKeyVar);
+    unsigned shift = keyWidth;
+    for (size_t i = 0; i < components.size(); i++) {
+        shift -= widths[i];
+        if (i != 0)
+            builder->append(" | ");
+        builder->append("(");
+        // masked to its width like the keyset constants, also when it is
+        // signed and the cast sign-extends it
+        builder->append("((u64)(");
+        emitMasked(components.at(i));
+        builder->append(")");
+        if (widths[i] < 64)
+            builder->appendFormat(" & %s", hexConstant(widthMask(widths[i])).c_str());
+        builder->append(")");
+        if (shift != 0)
+            builder->appendFormat(" << %d", shift);
+        builder->append(")");
+    }
+    builder->endOfStatement(true);
+
+    if (!exact) {
+        emitSelectChain(cases, fallback);
+    } else {
+        // the first case wins for duplicate values
+        std::map<uint64_t, const IR::ParserState*> byValue;
+        std::set<const IR::ParserState*> targets;
+        for (auto& c : cases) {
+            if (byValue.emplace(c.value, c.target).second)
+                targets.emplace(c.target);
+        }
+        std::vector<std::pair<uint64_t, const IR::ParserState*>> values(byValue.begin(), byValue.end());
+
+        // With a profile, a state that takes more than half of the packets
+        // through a single value is tested for before the general dispatch.
+        uint64_t total = edgeCount(fallback);
+        for (auto t : targets)
+            total += edgeCount(t);
+        for (auto t : targets) {
+            uint64_t hot = edgeCount(t);
+            if (hot == 0 || hot * 2 <= total)
+                continue;
+            auto first = std::find_if(values.begin(), values.end(),
+                [t](const std::pair<uint64_t, const IR::ParserState*>& v) { return v.second == t; });
+            if (std::count_if(values.begin(), values.end(),
+                [t](const std::pair<uint64_t, const IR::ParserState*>& v) { return v.second == t; }) != 1)
+                continue;
+            builder->emitIndent();
+            cstring test = cstring(selectKeyVar) + " == " + hexConstant(first->first);
+            builder->appendFormat("if (%s) ", hinted(test, hot, total - hot).c_str());
+            emitGoto(t);
+            builder->newline();
+            values.erase(first);
+            targets.erase(t);
+            break;
+        }
+
+        uint64_t span = values.empty() ? 0 : values.back().first - values.front().first;
+        if (values.size() >= 3 && span < 64 && targets.size() <= 2)
+            emitSelectBitmaps(values);
+        else if (values.size() >= 4 && span / 4 < values.size())
+            emitSelectSwitch(values);
+        else if (!values.empty())
+            emitSelectSearch(values, 0, values.size(), fallback);
+    }
 
-    for (auto e : expression->selectCases)
-        visit(e);
+    builder->emitIndent();
+    emitGoto(fallback);
+    builder->newline();
+    builder->blockEnd(true);
+    return false;
+}
+
+void StateTranslationVisitor::emitSelectChain(
+    const std::vector<SelectCaseKey>& cases, const IR::ParserState* fallback) {
+    std::set<const IR::ParserState*> targets = { fallback };
+    for (auto& c : cases)
+        targets.emplace(c.target);
+    uint64_t total = 0;
+    for (auto t : targets)
+        total += edgeCount(t);
 
-    if (!hasDefault) {
+    for (auto& c : cases) {
+        cstring condition = "";
+        if (c.mask != 0)
+            condition = cstring("(") + selectKeyVar + " & " + hexConstant(c.mask) + ") == " +
+                    hexConstant(c.value);
+        for (auto& r : c.ranges) {
+            if (!condition.isNullOrEmpty())
+                condition += " && ";
+            cstring field = cstring("((") + selectKeyVar + " >> " + Util::toString(r.shift) +
+                    ") & " + hexConstant(r.mask) + ")";
+            condition += field + " >= " + hexConstant(r.low) + " && " +
+                    field + " <= " + hexConstant(r.high);
+        }
+        uint64_t taken = edgeCount(c.target);
         builder->emitIndent();
-        builder->appendFormat("default: goto %s;", IR::ParserState::reject.c_str());
+        builder->appendFormat("if (%s) ", hinted(condition, taken, total - taken).c_str());
+        emitGoto(c.target);
         builder->newline();
     }
+}
 
+void StateTranslationVisitor::emitSelectBitmaps(
+    const std::vector<std::pair<uint64_t, const IR::ParserState*>>& values) {
+    uint64_t base = values.front().first;
+    uint64_t span = values.back().first - base;
+    std::map<const IR::ParserState*, uint64_t> bitmaps;
+    std::vector<const IR::ParserState*> order;
+    for (auto& v : values) {
+        if (bitmaps.count(v.second) == 0)
+            order.push_back(v.second);
+        bitmaps[v.second] |= 1ULL << (v.first - base);
+    }
+    // test the hotter state first
+    std::stable_sort(order.begin(), order.end(),
+        [this](const IR::ParserState* a, const IR::ParserState* b) { return edgeCount(a) > edgeCount(b); });
+
+    builder->emitIndent();
+    builder->appendFormat("if (%s - %s <= %s) ", selectKeyVar,
+                          hexConstant(base).c_str(), hexConstant(span).c_str());
+    builder->blockStart();
+    for (auto target : order) {
+        builder->emitIndent();
+        builder->appendFormat("if ((1ULL << (%s - %s)) & %s) ", selectKeyVar,
+                              hexConstant(base).c_str(), hexConstant(bitmaps[target]).c_str());
+        emitGoto(target);
+        builder->newline();
+    }
     builder->blockEnd(true);
-    return false;
 }
 
-bool StateTranslationVisitor::preorder(const IR::SelectCase* selectCase) {
+void StateTranslationVisitor::emitSelectSwitch(
+    const std::vector<std::pair<uint64_t, const IR::ParserState*>>& values) {
+    // The compiler still builds a jump table; hot cases come first for
+    // when it decides to emit compares instead.
+    auto ordered = values;
+    std::stable_sort(ordered.begin(), ordered.end(),
+        [this](const std::pair<uint64_t, const IR::ParserState*>& a,
+               const std::pair<uint64_t, const IR::ParserState*>& b) {
+            return edgeCount(a.second) > edgeCount(b.second); });
     builder->emitIndent();
-    if (selectCase->keyset->is<IR::DefaultExpression>()) {
-        hasDefault = true;
-        builder->append("default: ");
-    } else {
-        builder->append("case ");
-        visit(selectCase->keyset);
-        builder->append(": ");
+    builder->appendFormat("switch (%s) ", selectKeyVar);
+    builder->blockStart();
+    for (auto& v : ordered) {
+        builder->emitIndent();
+        builder->appendFormat("case %s: ", hexConstant(v.first).c_str());
+        emitGoto(v.second);
+        builder->newline();
     }
-    builder->append("goto ");
-    visit(selectCase->state);
-    builder->endOfStatement(true);
-    return false;
+    builder->blockEnd(true);
+}
+
+void StateTranslationVisitor::emitSelectSearch(
+    const std::vector<std::pair<uint64_t, const IR::ParserState*>>& values,
+    size_t low, size_t high, const IR::ParserState* fallback) {
+    if (high - low <= 3) {
+        for (size_t i = low; i < high; i++) {
+            builder->emitIndent();
+            builder->appendFormat("if (%s == %s) ", selectKeyVar, hexConstant(values[i].first).c_str());
+            emitGoto(values[i].second);
+            builder->newline();
+        }
+        return;
+    }
+    size_t middle = low + (high - low) / 2;
+    builder->emitIndent();
+    builder->appendFormat("if (%s < %s) ", selectKeyVar, hexConstant(values[middle].first).c_str());
+    builder->blockStart();
+    emitSelectSearch(values, low, middle, fallback);
+    builder->emitIndent();
+    emitGoto(fallback);
+    builder->newline();
+    builder->blockEnd(true);
+    emitSelectSearch(values, middle, high, fallback);
 }
 
 void
@@ -188,7 +677,7 @@ StateTranslationVisitor::compileExtractField(
 
     builder->appendFormat("memcpy(&");
     visit(expr);
-    builder->appendFormat(".%s, %s + BYTES(%s), BYTES(%d));", field.c_str(), program->packetStartVar.c_str(), program->offsetVar.c_str(), loadSize);
+    builder->appendFormat(".%s, %s + %s, BYTES(%d));", field.c_str(), program->packetStartVar.c_str(), byteOffset().c_str(), loadSize);
 
     if (loadSize > 8){
         builder->newline();
@@ -219,15 +708,19 @@ StateTranslationVisitor::compileExtractField(
     }
 
     builder->newline();
-    builder->emitIndent();
-    builder->appendFormat("%s += %d", program->offsetVar.c_str(), widthToExtract);
-
-    builder->endOfStatement(true);
+    advance(widthToExtract);
     builder->newline();
 }
 
+/*
+  'destination' may be the next element of a header stack, which is
+  bounds-checked and indexed by the stack's nextIndex.  A header with a
+  varbit field takes the field's length in bits as 'length'; it is copied
+  with a single memcpy and must be a whole number of bytes.
+*/
 void
-StateTranslationVisitor::compileExtract(const IR::Expression* destination) {
+StateTranslationVisitor::compileExtract(const IR::Expression* destination,
+                                        const IR::Expression* length) {
     auto type = state->parser->typeMap->getType(destination);
     auto ht = type->to<IR::Type_StructLike>();
     if (ht == nullptr) {
@@ -235,21 +728,86 @@ StateTranslationVisitor::compileExtract(const IR::Expression* destination) {
         return;
     }
 
-    unsigned width = ht->width_bits();
     auto program = state->parser->program;
-    builder->emitIndent();
-    builder->appendFormat("if ((%s * 8) < %d) ", program->inPacketLengthVar.c_str(), width);
-    builder->blockStart();
+    cstring stackNext;
+    auto member = destination->to<IR::Member>();
+    if (member != nullptr && member->member.name == IR::Type_Stack::next &&
+        state->parser->typeMap->getType(member->expr)->is<IR::Type_Stack>()) {
+        auto stack = member->expr->to<IR::Member>();
+        if (stack == nullptr) {
+            ::error("%1%: only header stacks within structs are supported", destination);
+            return;
+        }
+        auto next = new IR::Member(stack->expr, WP4StackType::nextIndex(stack->member.name));
+        auto st = state->parser->typeMap->getType(member->expr)->to<IR::Type_Stack>();
+        // error.StackOutOfBounds
+        builder->emitIndent();
+        builder->append("if (");
+        visit(next);
+        builder->appendFormat(" >= %d) ", st->getSize());
+        emitGoto(IR::ParserState::reject);
+        builder->newline();
+        stackNext = render(next);
+        destination = new IR::ArrayIndex(stack, next);
+    }
+
+    unsigned width = ht->width_bits();
+    cstring varbitLength;
+    const IR::StructField* varbit = nullptr;
+    for (auto f : ht->fields)
+        if (state->parser->typeMap->getType(f)->is<IR::Type_Varbits>())
+            varbit = f;
+    if ((varbit != nullptr) != (length != nullptr)) {
+        ::error("%1%: a varbit field needs the two-argument extract", destination);
+        return;
+    }
+    if (varbit != nullptr) {
+        unsigned maxWidth = state->parser->typeMap->getType(varbit)->to<IR::Type_Varbits>()->size;
+        width -= maxWidth;
+        // error.ParserInvalidArgument
+        varbitLength = WP4Model::reserved("varbitLength");
+        builder->emitIndent();
+        builder->blockStart();
+        builder->emitIndent();
+        builder->appendFormat("u32 %s = ", varbitLength.c_str());
+        emitMasked(length);
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("if (%s > %d || %s %% 8) ", varbitLength.c_str(), maxWidth,
+                              varbitLength.c_str());
+        emitGoto(IR::ParserState::reject);
+        builder->newline();
+    }
 
     builder->emitIndent();
-    builder->newline();
+    cstring extra = varbitLength.isNullOrEmpty() ? cstring("") : " + " + varbitLength;
+    if (constOffset >= 0)
+        builder->appendFormat("if ((%s * 8) < %d%s) ",
+                              program->inPacketLengthVar.c_str(), constOffset + width, extra.c_str());
+    else
+        builder->appendFormat("if ((%s * 8) < %s + %d%s) ",
+                              program->inPacketLengthVar.c_str(), program->offsetVar.c_str(), width,
+                              extra.c_str());
+    builder->blockStart();
 
     builder->emitIndent();
-    builder->appendFormat("goto %s;", IR::ParserState::accept.c_str());
+    emitGoto(IR::ParserState::accept);
     builder->newline();
     builder->blockEnd(true);
 
+    if (ht->is<IR::Type_Header>()) {
+        // lets the deparser leave unmodified headers in place
+        builder->emitIndent();
+        visit(destination);
+        if (constOffset >= 0)
+            builder->appendFormat(".wp4_offset = %d;", constOffset);
+        else
+            builder->appendFormat(".wp4_offset = %s;", program->offsetVar.c_str());
+        builder->newline();
+    }
+
     unsigned alignment = 0;
+    unsigned skipped = 0;
     for (auto f : ht->fields) {
         auto ftype = state->parser->typeMap->getType(f);
         auto etype = WP4TypeFactory::instance->create(ftype);
@@ -258,16 +816,58 @@ StateTranslationVisitor::compileExtract(const IR::Expression* destination) {
             ::error("Only headers with fixed widths supported %1%", f);
             return;
         }
-        compileExtractField(destination, f->name, alignment, etype);
+        if (f == varbit) {
+            if (alignment != 0) {
+                ::error("%1%: varbit fields must start on a byte boundary", f);
+                return;
+            }
+            if (skipped != 0)
+                advance(skipped);
+            skipped = 0;
+            if (!EliminateDeadFields::isDead(f)) {
+                builder->emitIndent();
+                builder->append("memcpy(");
+                visit(destination);
+                builder->appendFormat(".%s, %s + %s, BYTES(%s));", f->name.name.c_str(),
+                                      program->packetStartVar.c_str(), byteOffset().c_str(),
+                                      varbitLength.c_str());
+                builder->newline();
+            }
+            builder->emitIndent();
+            visit(destination);
+            builder->appendFormat(".%s = %s;", WP4VarbitType::lengthField().c_str(),
+                                  varbitLength.c_str());
+            builder->newline();
+            advance(varbitLength);
+            continue;
+        }
+        if (EliminateDeadFields::isDead(f)) {
+            // Nothing reads this field: only advance over it
+            skipped += et->widthInBits();
+        } else {
+            if (skipped != 0)
+                advance(skipped);
+            skipped = 0;
+            compileExtractField(destination, f->name, alignment, etype);
+        }
         alignment += et->widthInBits();
         alignment %= 8;
     }
+    if (skipped != 0)
+        advance(skipped);
 
     if (ht->is<IR::Type_Header>()) {
         builder->emitIndent();
         visit(destination);
         builder->appendLine(".wp4_valid = 1;");
     }
+    if (!stackNext.isNullOrEmpty()) {
+        builder->emitIndent();
+        builder->appendFormat("%s++;", stackNext.c_str());
+        builder->newline();
+    }
+    if (varbit != nullptr)
+        builder->blockEnd(true);
 }
 
 bool StateTranslationVisitor::preorder(const IR::MethodCallExpression* expression) {
@@ -291,11 +891,9 @@ bool StateTranslationVisitor::preorder(const IR::MethodCallExpression* expressio
         auto decl = extMethod->object;
         if (decl == state->parser->packet) {
             if (extMethod->method->name.name == p4lib.packetIn.extract.name) {
-                if (expression->arguments->size() != 1) {
-                    ::error("Variable-sized header fields not yet supported %1%", expression);
-                    return false;
-                }
-                compileExtract(expression->arguments->at(0)->expression);
+                auto args = expression->arguments;
+                compileExtract(args->at(0)->expression,
+                               args->size() == 2 ? args->at(1)->expression : nullptr);
                 return false;
             }
             BUG("Unhandled packet method %1%", expression->method);
@@ -308,6 +906,8 @@ bool StateTranslationVisitor::preorder(const IR::MethodCallExpression* expressio
 }
 
 bool StateTranslationVisitor::preorder(const IR::Member* expression) {
+    if (stackMember(expression))
+        return false;
     if (expression->expr->is<IR::PathExpression>()) {
         auto pe = expression->expr->to<IR::PathExpression>();
         auto decl = state->parser->program->refMap->getDeclaration(pe->path, true);
@@ -325,12 +925,35 @@ bool StateTranslationVisitor::preorder(const IR::Member* expression) {
 
 //////////////////////////////////////////////////////////////////
 
-void WP4ParserState::emit(CodeBuilder* builder) {
-    StateTranslationVisitor visitor(this);
+void WP4ParserState::emit(CodeBuilder* builder, int entryOffset) {
+    StateTranslationVisitor visitor(this, entryOffset);
     visitor.setBuilder(builder);
     state->apply(visitor);
 }
 
+std::vector<const IR::ParserState*> WP4ParserState::successors() const {
+    std::vector<const IR::ParserState*> result;
+    auto add = [this, &result](const IR::Expression* e) {
+        auto pe = e->to<IR::PathExpression>();
+        if (pe == nullptr)
+            return;
+        auto decl = parser->program->refMap->getDeclaration(pe->path, true);
+        if (auto ps = decl->getNode()->to<IR::ParserState>())
+            result.push_back(ps);
+    };
+
+    auto select = state->selectExpression;
+    if (select == nullptr)
+        return result;
+    if (auto se = select->to<IR::SelectExpression>()) {
+        for (auto c : se->selectCases)
+            add(c->state);
+    } else {
+        add(select);
+    }
+    return result;
+}
+
 WP4Parser::WP4Parser(const WP4Program* program, const IR::ParserBlock* block, const P4::TypeMap* typeMap) :
         program(program), typeMap(typeMap), parserBlock(block),
         packet(nullptr), headers(nullptr), headerType(nullptr) {}
@@ -353,8 +976,30 @@ void WP4Parser::emitDeclaration(CodeBuilder* builder, const IR::Declaration* dec
 void WP4Parser::emit(CodeBuilder* builder) {
     for (auto l : parserBlock->container->parserLocals)
         emitDeclaration(builder, l);
-    for (auto s : states)
-        s->emit(builder);
+
+    // Hot states first, so the common path falls through in the i-cache;
+    // the start state always comes first.
+    auto ordered = states;
+    auto profile = program->profile;
+    if (profile->hasCounts()) {
+        std::stable_sort(ordered.begin(), ordered.end(),
+            [profile](const WP4ParserState* a, const WP4ParserState* b) {
+                bool aStart = a->state->name.name == IR::ParserState::start;
+                bool bStart = b->state->name.name == IR::ParserState::start;
+                if (aStart || bStart)
+                    return aStart && !bStart;
+                return profile->stateCount(a->state->name.name) >
+                       profile->stateCount(b->state->name.name); });
+    }
+    for (auto s : ordered) {
+        // one copy per constant entry offset; unreachable states have none
+        auto it = entryOffsets.find(s->state);
+        if (it != entryOffsets.end())
+            for (auto offset : it->second)
+                s->emit(builder, offset);
+        if (dynamicStates.count(s->state) != 0)
+            s->emit(builder, -1);
+    }
     builder->newline();
 
     // Create a synthetic reject state
@@ -376,8 +1021,10 @@ bool WP4Parser::build() {
     headers = *it;
     for (auto state : parserBlock->container->states) {
         auto ps = new WP4ParserState(state, this);
+        computeWidth(ps);
         states.push_back(ps);
     }
+    computeEntryOffsets();
 
     auto ht = typeMap->getType(headers);
     if (ht == nullptr)
@@ -386,4 +1033,142 @@ bool WP4Parser::build() {
     return true;
 }
 
+WP4ParserState* WP4Parser::getState(const IR::ParserState* state) const {
+    for (auto s : states)
+        if (s->state == state)
+            return s;
+    BUG("%1%: no such state", state);
+}
+
+void WP4Parser::computeWidth(WP4ParserState* ps) {
+    auto& p4lib = P4::P4CoreLibrary::instance;
+    ps->width = 0;
+    ps->fixedWidth = true;
+    for (auto c : ps->state->components) {
+        auto mcs = c->to<IR::MethodCallStatement>();
+        if (mcs == nullptr)
+            continue;
+        auto mi = P4::MethodInstance::resolve(mcs->methodCall, program->refMap, program->typeMap);
+        auto em = mi->to<P4::ExternMethod>();
+        if (em == nullptr || em->object != packet ||
+            em->method->name.name != p4lib.packetIn.extract.name)
+            continue;
+        auto args = mcs->methodCall->arguments;
+        if (auto member = args->at(0)->expression->to<IR::Member>()) {
+            auto st = typeMap->getType(member->expr);
+            if (member->member.name == IR::Type_Stack::next && st != nullptr &&
+                st->is<IR::Type_Stack>())
+                ps->stackSize = std::max(ps->stackSize, st->to<IR::Type_Stack>()->getSize());
+        }
+        auto type = typeMap->getType(args->at(0)->expression);
+        auto ht = type == nullptr ? nullptr : type->to<IR::Type_StructLike>();
+        if (args->size() != 1 || ht == nullptr) {
+            ps->fixedWidth = false;
+            return;
+        }
+        ps->width += ht->width_bits();
+    }
+}
+
+void WP4Parser::markDynamic(const IR::ParserState* state, bool keepCopies) {
+    if (state->isBuiltin() || !dynamicStates.emplace(state).second)
+        return;
+    if (!keepCopies)
+        entryOffsets.erase(state);
+    for (auto next : getState(state)->successors())
+        markDynamic(next);
+}
+
+// Propagate the constant offset 0 of the start state along all transitions.
+// A state reached at too many offsets, or one that extracts a variable
+// amount of data, falls back to the run-time offset, as do its successors.
+// A loop over a header stack is unrolled instead: it runs at most once per
+// element with constant offsets, and in the dynamic copy after that.
+void WP4Parser::computeEntryOffsets() {
+    const IR::ParserState* start = nullptr;
+    for (auto s : states)
+        if (s->state->name.name == IR::ParserState::start)
+            start = s->state;
+    if (start == nullptr) {
+        for (auto s : states)
+            markDynamic(s->state);
+        return;
+    }
+
+    entryOffsets[start].emplace(0);
+    if (!getState(start)->fixedWidth)
+        markDynamic(start);
+    std::deque<const IR::ParserState*> work = { start };
+    while (!work.empty()) {
+        auto current = work.front();
+        work.pop_front();
+        auto ps = getState(current);
+        bool dynamic = dynamicStates.count(current) != 0;
+        std::set<unsigned> exitOffsets;
+        auto copies = entryOffsets.find(current);
+        if (copies != entryOffsets.end())
+            for (auto o : copies->second)
+                exitOffsets.emplace(o + ps->width);
+
+        for (auto next : ps->successors()) {
+            if (next->isBuiltin())
+                continue;
+            if (dynamic || !getState(next)->fixedWidth) {
+                markDynamic(next);
+                continue;
+            }
+            if (dynamicStates.count(next) != 0 && entryOffsets.count(next) == 0)
+                continue;
+            auto& offsets = entryOffsets[next];
+            unsigned stackSize = getState(next)->stackSize;
+            // one more copy than the stack has elements: the last one rejects
+            unsigned limit = maxSpecializations;
+            limit = std::max(limit, stackSize + 1);
+            bool changed = false, overflow = false;
+            for (auto o : exitOffsets) {
+                if (offsets.count(o) != 0)
+                    continue;
+                if (stackSize != 0 && offsets.size() >= limit) {
+                    overflow = true;
+                    continue;
+                }
+                offsets.emplace(o);
+                changed = true;
+            }
+            if (overflow)
+                markDynamic(next, true);
+            else if (offsets.size() > limit)
+                markDynamic(next);
+            if (changed && entryOffsets.count(next) != 0)
+                work.push_back(next);
+        }
+    }
+}
+
+bool WP4Parser::specialized(const IR::ParserState* state, int offset) const {
+    auto it = entryOffsets.find(state);
+    return offset >= 0 && it != entryOffsets.end() && it->second.count(offset) != 0;
+}
+
+cstring WP4Parser::stateLabel(const IR::ParserState* state, int offset) const {
+    cstring name = state->name.name;
+    if (state->isBuiltin())
+        return name;
+    if (!specialized(state, offset)) {
+        BUG_CHECK(dynamicStates.count(state) != 0,
+                  "%1%: not specialized for offset %2%", state, offset);
+        return name;
+    }
+    if (entryOffsets.at(state).size() == 1 && dynamicStates.count(state) == 0)
+        return name;
+    return name + "_" + Util::toString(offset);
+}
+
+cstring WP4Parser::startLabel() const {
+    for (auto s : states)
+        if (s->state->name.name == IR::ParserState::start)
+            return stateLabel(s->state, 0);
+    return IR::ParserState::start;
+}
+
 }  // namespace WP4
@@ -29,10 +29,19 @@ class WP4ParserState : public WP4Object {
  public:
     const IR::ParserState* state;
     const WP4Parser* parser;
+    // Bits extracted by this state; only meaningful if fixedWidth
+    unsigned width;
+    bool fixedWidth;
+    // Size of the largest header stack this state extracts the next element
+    // of: a loop through the state runs at most that many times.
+    unsigned stackSize;
 
     WP4ParserState(const IR::ParserState* state, WP4Parser* parser) :
-            state(state), parser(parser) {}
-    void emit(CodeBuilder* builder);
+            state(state), parser(parser), width(0), fixedWidth(false), stackSize(0) {}
+    // entryOffset is the constant packet offset in bits this copy of the
+    // state is specialized for, or -1 if the offset is only known at run time.
+    void emit(CodeBuilder* builder, int entryOffset);
+    std::vector<const IR::ParserState*> successors() const;
 };
 
 class WP4Parser : public WP4Object {
@@ -45,10 +54,35 @@ class WP4Parser : public WP4Object {
     const IR::Parameter*              headers;
     WP4Type*                     headerType;
 
+    // A state reached at more distinct constant offsets than this is
+    // emitted once, using the run-time offset.  States that extract into a
+    // header stack are unrolled up to the stack size instead.
+    static const unsigned maxSpecializations = 4;
+    // Constant packet offsets (in bits) at which each state can be entered.
+    // A state gets one straight-line copy per offset, in which all loads use
+    // immediate offsets and the offset variable is only written when leaving
+    // for a state that needs it.
+    std::map<const IR::ParserState*, std::set<unsigned>> entryOffsets;
+    // States entered at an offset that is only known at run time.  A state
+    // that loops over a header stack can have both: copies for the first
+    // iterations and a dynamic one for the rest.
+    std::set<const IR::ParserState*> dynamicStates;
+
     explicit WP4Parser(const WP4Program* program, const IR::ParserBlock* block, const P4::TypeMap* typeMap);
     void emitDeclaration(CodeBuilder* builder, const IR::Declaration* decl);
     void emit(CodeBuilder* builder);
     bool build();
+    WP4ParserState* getState(const IR::ParserState* state) const;
+    // Label of the copy of 'state' entered at 'offset' (-1 when dynamic)
+    cstring stateLabel(const IR::ParserState* state, int offset) const;
+    // True if 'state' has a copy for the constant 'offset'
+    bool specialized(const IR::ParserState* state, int offset) const;
+    cstring startLabel() const;
+
+ protected:
+    void computeWidth(WP4ParserState* state);
+    void computeEntryOffsets();
+    void markDynamic(const IR::ParserState* state, bool keepCopies = false);
 };
 
 }  // namespace WP4
@@ -0,0 +1,137 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "wp4-Profile.h"
+#include "lib/error.h"
+
+namespace WP4 {
+
+namespace {
+const char* reportTag = "WP4-PROFILE:";
+// a branch is hinted if it goes one way this many times more often
+const uint64_t hintRatio = 4;
+}  // namespace
+
+bool WP4Profile::load(cstring file) {
+    std::ifstream in(file.c_str());
+    if (!in.is_open()) {
+        ::error("%s: No such file or directory.", file);
+        return false;
+    }
+    std::string line;
+    unsigned lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        // only the report lines of a kernel log, with whatever is in front of the tag
+        auto tag = line.find(reportTag);
+        if (tag == std::string::npos)
+            continue;
+        std::istringstream fields(line.substr(tag + strlen(reportTag)));
+        std::string name;
+        uint64_t value;
+        if (!(fields >> name) || name[0] == '#')
+            continue;
+        if (!(fields >> value)) {
+            ::error("%s:%d: expected a counter name and a count", file, lineNumber);
+            return false;
+        }
+        counts[name] += value;
+    }
+    return true;
+}
+
+uint64_t WP4Profile::count(cstring name) const {
+    auto it = counts.find(name);
+    return it == counts.end() ? 0 : it->second;
+}
+
+uint64_t WP4Profile::stateCount(cstring state) const {
+    cstring suffix = cstring(":") + state;
+    uint64_t result = 0;
+    for (auto& c : counts)
+        if (c.first.startsWith("parser:") && c.first.endsWith(suffix))
+            result += c.second;
+    return result;
+}
+
+cstring WP4Profile::hint(uint64_t taken, uint64_t notTaken) const {
+    if (taken > hintRatio * notTaken)
+        return "likely";
+    if (notTaken > hintRatio * taken)
+        return "unlikely";
+    return "";
+}
+
+cstring WP4Profile::increment(cstring name) {
+    if (!instrument)
+        return "";
+    auto it = counterIndex.find(name);
+    unsigned index;
+    if (it != counterIndex.end()) {
+        index = it->second;
+    } else {
+        index = counters.size();
+        counters.push_back(name);
+        counterIndex.emplace(name, index);
+    }
+    return arrayName + "[" + Util::toString(index) + "]++;";
+}
+
+void WP4Profile::emitDeclarations(CodeBuilder* builder) const {
+    if (!instrument || counters.empty())
+        return;
+    // Increments from different CPUs may race; a few lost counts do not
+    // change the layout decisions.
+    unsigned size = counters.size();
+    builder->appendFormat("static u64 %s[%d];", arrayName.c_str(), size);
+    builder->newline();
+    builder->appendFormat("static const char *%s_names[%d] = ", arrayName.c_str(), size);
+    builder->blockStart();
+    for (auto c : counters) {
+        builder->emitIndent();
+        builder->appendFormat("\"%s\",", c.c_str());
+        builder->newline();
+    }
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+}
+
+void WP4Profile::emitReport(CodeBuilder* builder) const {
+    if (!instrument || counters.empty())
+        return;
+    builder->emitIndent();
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendLine("int i;");
+    builder->emitIndent();
+    builder->appendFormat("for (i = 0; i < %d; i++)", static_cast<unsigned>(counters.size()));
+    builder->newline();
+    builder->increaseIndent();
+    builder->emitIndent();
+    builder->appendFormat("printk(KERN_INFO \"%s %%s %%llu\\n\", %s_names[i], %s[i]);",
+                          reportTag, arrayName.c_str(), arrayName.c_str());
+    builder->newline();
+    builder->decreaseIndent();
+    builder->blockEnd(true);
+}
+
+}  // namespace WP4
@@ -0,0 +1,74 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_WP4_PROFILE_H_
+#define _BACKENDS_WP4_PROFILE_H_
+
+#include "lib/cstring.h"
+#include "wp4-CodeGen.h"
+
+namespace WP4 {
+
+/**
+  Branch profiles for the generated switch.
+
+  With --profile-gen every parser transition, table hit and miss and
+  every action a table runs gets a counter.  The counters are printed to
+  the kernel log when the module is removed, one "WP4-PROFILE: name count"
+  line each.  Those lines (e.g. the output of dmesg) are read back with
+  --profile-use; counts of repeated names are added up.  The code
+  generators then lay out hot parser states first, test frequent select
+  cases and actions first and emit likely/unlikely hints.
+*/
+class WP4Profile {
+    // counters of an instrumented build, by index
+    std::vector<cstring> counters;
+    std::map<cstring, unsigned> counterIndex;
+    // counts read with --profile-use
+    std::map<cstring, uint64_t> counts;
+
+ public:
+    bool instrument = false;
+    cstring arrayName = "wp4_profile";
+
+    static cstring transition(cstring state, cstring target)
+    { return cstring("parser:") + state + ":" + target; }
+    static cstring tableHit(cstring table)
+    { return cstring("table:") + table + ":hit"; }
+    static cstring tableMiss(cstring table)
+    { return cstring("table:") + table + ":miss"; }
+    static cstring action(cstring table, cstring action)
+    { return cstring("action:") + table + ":" + action; }
+
+    // Reads a profile; returns false and reports an error on failure.
+    bool load(cstring file);
+    bool hasCounts() const { return !counts.empty(); }
+    uint64_t count(cstring name) const;
+    // Sum of the counts of all transitions into 'state'
+    uint64_t stateCount(cstring state) const;
+    // "likely" or "unlikely" if the profile shows a strong bias between a
+    // branch and its alternative, empty otherwise.
+    cstring hint(uint64_t taken, uint64_t notTaken) const;
+    // C statement counting 'name' in an instrumented build, empty otherwise
+    cstring increment(cstring name);
+
+    void emitDeclarations(CodeBuilder* builder) const;
+    void emitReport(CodeBuilder* builder) const;
+};
+
+}  // namespace WP4
+
+#endif  /* _BACKENDS_WP4_PROFILE_H_ */
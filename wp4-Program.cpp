@@ -22,6 +22,8 @@ limitations under the License.
 #include "wp4-Control.h"
 #include "wp4-Parser.h"
 #include "wp4-Table.h"
+#include "wp4-DirtyFields.h"
+#include "wp4-FlowCache.h"
 #include "frontends/p4/coreLibrary.h"
 #include "frontends/common/options.h"
 
@@ -52,6 +54,12 @@ bool WP4Program::build() {
     if (!success)
         return success;
 
+    if (flowCacheSize != 0) {
+        flowCache = new WP4FlowCache(this, flowCacheSize);
+        if (!flowCache->build())
+            flowCache = nullptr;
+    }
+
     auto db = pack->getParameterValue(model.wp4_switch.wp4_deparser.name)->to<IR::ControlBlock>();
     BUG_CHECK(db != nullptr, "No deparser block found");
     deparser = new WP4Deparser(this, db, parser->headers);
@@ -59,7 +67,10 @@ bool WP4Program::build() {
     if (!success)
         return success;
 
-    return true;
+    FindDirtyFields findDirty(refMap, typeMap, &dirtyFields);
+    pb->container->apply(findDirty);
+    cb->container->apply(findDirty);
+    return ::errorCount() == 0;
 }
 
 void WP4Program::emitC(CodeBuilder* builder, cstring header) {
@@ -73,11 +84,16 @@ void WP4Program::emitC(CodeBuilder* builder, cstring header) {
     builder->newline();
 
     emitPreamble(builder);
-    builder->target->emitModule(builder);
+
+    // The switch function is generated first: it determines the profile
+    // counters that the module functions declare and report.
+    auto outer = builder;
+    CodeBuilder mainBuilder(builder->target);
+    builder = &mainBuilder;
     builder->emitIndent(); 
     builder->target->emitCodeSection(builder, functionName);
     builder->emitIndent();
-    builder->target->emitMain(builder, "wp4_packet_in", model.CPacketName.str(), "wp4_ul_size");
+    builder->target->emitMain(builder, "wp4_packet_in", skbVar);
     builder->blockStart();
 
     builder->newline();
@@ -89,7 +105,7 @@ void WP4Program::emitC(CodeBuilder* builder, cstring header) {
     emitLocalVariables(builder);
     builder->newline();
     builder->emitIndent();
-    builder->appendFormat("goto %s;", IR::ParserState::start.c_str());
+    builder->appendFormat("goto %s;", parser->startLabel().c_str());
     builder->newline();
 
     builder->appendFormat("\n// Start of Parser\n");
@@ -100,9 +116,25 @@ void WP4Program::emitC(CodeBuilder* builder, cstring header) {
 
     builder->appendFormat("\n// Start of Deparser\n");
     deparser->emit(builder);
-    builder->appendFormat("    return 0;");
-    builder->newline();
+    emitEgress(builder);
     builder->blockEnd(true);  // end of function
+
+    builder = outer;
+    builder->target->emitTransmitHook(builder);
+    if (egressScheduler) {
+        builder->appendFormat("static struct wp4_sched %s;", schedulerVar.c_str());
+        builder->newline();
+        builder->newline();
+    }
+    // table updates invalidate the flow cache
+    if (flowCache != nullptr)
+        flowCache->emitTypes(builder);
+    control->emitExternInstances(builder);
+    profile->emitDeclarations(builder);
+    emitProgramInit(builder);
+    emitProgramExit(builder);
+    builder->target->emitModule(builder);
+    builder->append(mainBuilder.toString());
     builder->appendFormat("\n// Kernel module functions\n");
     builder->append(
         "EXPORT_SYMBOL(wp4_packet_in);\n"
@@ -130,18 +162,104 @@ void WP4Program::emitH(CodeBuilder* builder, cstring) {
     builder->newline();
     builder->appendLine("#include <linux/types.h>");
     builder->newline();
-    builder->appendLine("int wp4_packet_in(u8 *p_uc_data, u16 wp4_ul_size, u8 port);");
+    builder->appendLine("struct sk_buff;");
+    builder->appendLine("int wp4_packet_in(struct sk_buff *skb, u32 port);");
     builder->newline();
     emitTypes(builder);
     control->emitTableTypes(builder);
     builder->newline();
-    //builder->appendLine("static void init_tables() ");
-    //builder->blockStart();
-    //builder->emitIndent();
-    //builder->appendFormat("u32 %s = 0;", zeroKey.c_str());
-    //builder->newline();
-    //control->emitTableInitializers(builder);
-    //builder->blockEnd(true);
+    builder->appendLine("#endif");
+}
+
+// A header-only userspace library that updates the tables of the loaded
+// module through their files in debugfs.
+void WP4Program::emitControlPlane(CodeBuilder* builder) {
+    emitGeneratedComment(builder);
+    builder->appendLine("#ifndef _P4_GEN_CTL_HEADER_");
+    builder->appendLine("#define _P4_GEN_CTL_HEADER_");
+    builder->newline();
+    builder->append(
+        "#include <errno.h>\n"
+        "#include <fcntl.h>\n"
+        "#include <stdint.h>\n"
+        "#include <stdlib.h>\n"
+        "#include <unistd.h>\n"
+        "#include <sys/ioctl.h>\n"
+        "#include <sys/types.h>\n"
+        "#include <linux/types.h>\n"
+        "\n");
+    for (auto w : { 8, 16, 32, 64 }) {
+        builder->appendFormat("typedef __u%d u%d;", w, w);
+        builder->newline();
+        builder->appendFormat("typedef __s%d s%d;", w, w);
+        builder->newline();
+    }
+    builder->newline();
+    // as in wp4_runtime.h
+    builder->append(
+        "#define WP4_TABLE_ADD 1\n"
+        "#define WP4_TABLE_MODIFY 2\n"
+        "#define WP4_TABLE_DELETE 3\n"
+        "#define WP4_TABLE_SET_DEFAULT 4\n"
+        "\n"
+        "struct wp4_table_batch {\n"
+        "    u64 records;\n"
+        "    u32 count;\n"
+        "    u32 failed;\n"
+        "};\n"
+        "\n"
+        "#define WP4_TABLE_IOC_BATCH _IOWR('W', 1, struct wp4_table_batch)\n"
+        "#define WP4_TABLE_IOC_SHADOW _IO('W', 2)\n"
+        "#define WP4_TABLE_IOC_COMMIT _IO('W', 3)\n"
+        "#define WP4_TABLE_IOC_ABORT _IO('W', 4)\n"
+        "#define WP4_TABLE_IOC_ERROR _IO('W', 5)\n"
+        "\n"
+        "#define WP4_TABLES_DIR \"/sys/kernel/debug/wp4_tables\"\n"
+        "\n"
+        "static inline int wp4_ctl_write(int fd, const void *records, size_t size, size_t n,\n"
+        "                                size_t *applied) {\n"
+        "    ssize_t r = write(fd, records, size * n);\n"
+        "    if (applied != NULL)\n"
+        "        *applied = r < 0 ? 0 : r / size;\n"
+        "    if (r < 0)\n"
+        "        return -errno;\n"
+        "    /* a short write stopped at a failed record: ask for its error */\n"
+        "    if ((size_t)r < size * n)\n"
+        "        return ioctl(fd, WP4_TABLE_IOC_ERROR) < 0 ? -errno : -EIO;\n"
+        "    return 0;\n"
+        "}\n"
+        "\n"
+        "static inline int wp4_ctl_batch(int fd, const void *records, size_t n, size_t *failed) {\n"
+        "    struct wp4_table_batch b = { (u64)(uintptr_t)records, (u32)n, 0 };\n"
+        "    if (ioctl(fd, WP4_TABLE_IOC_BATCH, &b) < 0) {\n"
+        "        if (failed != NULL)\n"
+        "            *failed = b.failed;\n"
+        "        return -errno;\n"
+        "    }\n"
+        "    return 0;\n"
+        "}\n"
+        "\n"
+        "static inline ssize_t wp4_ctl_read(int fd, void *records, size_t size, size_t max) {\n"
+        "    size_t n = 0;\n"
+        "    ssize_t r;\n"
+        "    if (lseek(fd, 0, SEEK_SET) < 0)\n"
+        "        return -errno;\n"
+        "    while (n < max) {\n"
+        "        r = read(fd, (char *)records + n * size, (max - n) * size);\n"
+        "        if (r < 0)\n"
+        "            return -errno;\n"
+        "        if (r == 0)\n"
+        "            break;\n"
+        "        n += r / size;\n"
+        "    }\n"
+        "    return n;\n"
+        "}\n"
+        "\n");
+    emitTypes(builder);
+    control->emitTableTypes(builder);
+    builder->newline();
+    for (auto it : control->tables)
+        it.second->emitControlPlane(builder);
     builder->appendLine("#endif");
 }
 
@@ -181,21 +299,89 @@ void WP4Program::emitPreamble(CodeBuilder* builder) {
 }
 
 void WP4Program::emitLocalVariables(CodeBuilder* builder) {
+    builder->newline();
+    if (radiotap) {
+        // strips the radiotap header: the parser starts at offset 0 as usual
+        builder->emitIndent();
+        builder->appendFormat("struct wp4_radiotap %s;", radiotapVar.c_str());
+        builder->newline();
+        builder->emitIndent();
+        builder->appendFormat("int %s = wp4_radiotap_strip(%s, &%s);", radiotapLengthVar.c_str(),
+                              skbVar.c_str(), radiotapVar.c_str());
+        builder->newline();
+    }
+    // only the linear part of the frame is parsed
+    builder->emitIndent();
+    builder->appendFormat("u8 *%s = %s->data;", model.CPacketName.str(), skbVar.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("u16 %s = skb_headlen(%s);", inPacketLengthVar.c_str(), skbVar.c_str());
     builder->newline();
     builder->emitIndent();
     builder->appendFormat("u16 %s = 0;", offsetVar); 
     builder->newline();
     builder->emitIndent();
     builder->appendFormat("u8 *%s = %s;", packetStartVar, model.CPacketName.str());    
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("u16 %s = 0;", outHeaderLengthVar);
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("int %s = 0;", headerDeltaVar);
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("u8 %s = 0;", fcsUpdateVar);
+    if (flowCache != nullptr) {
+        builder->newline();
+        flowCache->emitLocalVariables(builder);
+    }
 
     builder->newline();
     builder->emitIndent();
-    builder->appendFormat("struct %s %s;\n", model.outputMetadataModel.name, getSwitch()->outputMeta->name.name);
+    builder->appendFormat("struct %s %s = { 0 };\n", model.outputMetadataModel.name, getSwitch()->outputMeta->name.name);
     builder->emitIndent();
-    builder->appendFormat("struct %s %s;\n", model.inputMetadataModel.name, getSwitch()->inputMeta->name.name);
+    builder->appendFormat("struct %s %s = { 0 };\n", model.inputMetadataModel.name, getSwitch()->inputMeta->name.name);
+    builder->emitIndent();
+    builder->appendFormat("struct wp4_egress %s;\n", WP4Model::reserved("egress").c_str());
     builder->emitIndent();
     builder->appendFormat("%s.%s = port;\n", getSwitch()->inputMeta->name.name, WP4Model::instance.inputMetadataModel.inputPort.str());
-    
+    if (radiotap) {
+        auto& im = model.inputMetadataModel;
+        cstring imd = getSwitch()->inputMeta->name.name;
+        builder->emitIndent();
+        builder->appendFormat("if (%s < 0) return %s;", radiotapLengthVar.c_str(),
+                              builder->target->dropReturnCode().c_str());
+        builder->newline();
+        for (auto f : { &im.rssi, &im.rate, &im.channelFreq, &im.channelFlags, &im.timestamp }) {
+            builder->emitIndent();
+            builder->appendFormat("%s.%s = %s.%s;", imd.c_str(), f->str(),
+                                  radiotapVar.c_str(), f->str());
+            builder->newline();
+        }
+    }
+}
+
+// Hands the frame to the runtime, which replicates and transmits it
+void WP4Program::emitEgress(CodeBuilder* builder) {
+    auto& om = model.outputMetadataModel;
+    cstring omd = getSwitch()->outputMeta->name.name;
+    cstring egress = WP4Model::reserved("egress");
+    // output_ports is a wide value, a byte array
+    builder->emitIndent();
+    builder->appendFormat("wp4_egress_set_ports(&%s, %s.%s);", egress.c_str(), omd.c_str(),
+                          om.outputPorts.str());
+    builder->newline();
+    for (auto f : { std::make_pair("port", &om.outputPort), std::make_pair("queue", &om.queue),
+                    std::make_pair("ac", &om.ac) }) {
+        builder->emitIndent();
+        builder->appendFormat("%s.%s = %s.%s;", egress.c_str(), f.first, omd.c_str(), f.second->str());
+        builder->newline();
+    }
+    builder->emitIndent();
+    cstring sched = egressScheduler ? "&" + schedulerVar : cstring("NULL");
+    builder->appendFormat("return wp4_egress(%s, &%s, READ_ONCE(wp4_xmit), %s);", skbVar.c_str(),
+                          egress.c_str(), sched.c_str());
+    builder->newline();
 }
 
 void WP4Program::emitHeaderInstances(CodeBuilder* builder) {
@@ -208,12 +394,61 @@ void WP4Program::emitPipeline(CodeBuilder* builder) {
     builder->append(IR::ParserState::accept);
     builder->append(":");
     builder->newline();
+    if (flowCache != nullptr)
+        flowCache->emitLookup(builder);
     builder->emitIndent();
     builder->blockStart();
     control->emit(builder);
     builder->blockEnd(true);
 }
 
+void WP4Program::emitProgramInit(CodeBuilder* builder) {
+    builder->append("static int wp4_program_init(void) ");
+    builder->blockStart();
+    cstring failLabel = WP4Model::reserved("nomem");
+    if (egressScheduler) {
+        builder->emitIndent();
+        builder->appendFormat("wp4_sched_init(&%s, &wp4_xmit);", schedulerVar.c_str());
+        builder->newline();
+    }
+    bool canFail = control->emitExternInit(builder, failLabel);
+    if (flowCache != nullptr) {
+        flowCache->emitAllocation(builder, failLabel);
+        canFail = true;
+    }
+    builder->emitIndent();
+    builder->appendLine("return 0;");
+    if (canFail) {
+        // free_percpu and debugfs_remove_recursive ignore what was not allocated
+        builder->appendFormat("%s:", failLabel.c_str());
+        builder->newline();
+        control->emitExternExit(builder);
+        if (flowCache != nullptr)
+            flowCache->emitFree(builder);
+        builder->emitIndent();
+        builder->appendLine("return -ENOMEM;");
+    }
+    builder->blockEnd(true);
+    builder->newline();
+}
+
+void WP4Program::emitProgramExit(CodeBuilder* builder) {
+    builder->append("static void wp4_program_exit(void) ");
+    builder->blockStart();
+    if (egressScheduler) {
+        // frames still queued are freed
+        builder->emitIndent();
+        builder->appendFormat("wp4_sched_exit(&%s);", schedulerVar.c_str());
+        builder->newline();
+    }
+    profile->emitReport(builder);
+    control->emitExternExit(builder);
+    if (flowCache != nullptr)
+        flowCache->emitFree(builder);
+    builder->blockEnd(true);
+    builder->newline();
+}
+
 WP4Control* WP4Program::getSwitch() const {
     return dynamic_cast<WP4Control*>(control);
 }
@@ -25,6 +25,8 @@ limitations under the License.
 #include "frontends/p4/evaluator/evaluator.h"
 #include "frontends/common/options.h"
 #include "wp4-CodeGen.h"
+#include "wp4-Profile.h"
+#include "wp4-DeadFields.h"
 
 namespace WP4 {
 
@@ -34,6 +36,7 @@ class WP4Control;
 class WP4Deparser;
 class WP4Table;
 class WP4Type;
+class WP4FlowCache;
 
 class WP4Program : public WP4Object {
  public:
@@ -46,6 +49,13 @@ class WP4Program : public WP4Object {
     WP4Deparser*    deparser;
     WP4Control*     control;
     WP4Model        &model;
+    WP4Profile*     profile;
+    unsigned        flowCacheSize;
+    WP4FlowCache*   flowCache;  // nullptr if the pipeline is not cached
+    bool            radiotap;   // strip and decode a leading radiotap header
+    bool            egressScheduler;  // queue frames per access category
+    // header fields that may differ from the packet bytes they were extracted from
+    FieldSet        dirtyFields;
 
     cstring endLabel, offsetVar, lengthVar;
     cstring zeroKey, functionName, errorVar;
@@ -54,6 +64,9 @@ class WP4Program : public WP4Object {
     cstring license = "GPL";  // TODO: this should be a compiler option probably
     cstring arrayIndexType = "u32";
     cstring inPacketLengthVar, outHeaderLengthVar;
+    cstring skbVar, headerDeltaVar, fcsUpdateVar;
+    cstring radiotapVar, radiotapLengthVar;
+    cstring schedulerVar;
 
     virtual bool build();  // return 'true' on success
 
@@ -61,7 +74,9 @@ class WP4Program : public WP4Object {
                 P4::ReferenceMap* refMap, P4::TypeMap* typeMap, const IR::ToplevelBlock* toplevel) :
             options(options), program(program), toplevel(toplevel),
             refMap(refMap), typeMap(typeMap),
-            parser(nullptr), control(nullptr), model(WP4Model::instance) {
+            parser(nullptr), control(nullptr), model(WP4Model::instance),
+            profile(new WP4Profile()), flowCacheSize(0), flowCache(nullptr), radiotap(false),
+            egressScheduler(false) {
         offsetVar = WP4Model::reserved("packetOffsetInBits");
         packetStartVar = WP4Model::reserved("packetStart");
         zeroKey = WP4Model::reserved("zero");
@@ -70,6 +85,12 @@ class WP4Program : public WP4Object {
         inPacketLengthVar = WP4Model::reserved("ul_size");
         outHeaderLengthVar = WP4Model::reserved("outHeaderLength");
         endLabel = WP4Model::reserved("end");
+        skbVar = "skb";
+        headerDeltaVar = WP4Model::reserved("headerDelta");
+        fcsUpdateVar = WP4Model::reserved("fcsUpdate");
+        radiotapVar = WP4Model::reserved("radiotap");
+        radiotapLengthVar = WP4Model::reserved("radiotapLength");
+        schedulerVar = WP4Model::reserved("sched");
     }
 
     virtual void emitGeneratedComment(CodeBuilder* builder);
@@ -78,8 +99,13 @@ class WP4Program : public WP4Object {
     virtual void emitHeaderInstances(CodeBuilder* builder);
     virtual void emitLocalVariables(CodeBuilder* builder);
     virtual void emitPipeline(CodeBuilder* builder);
+    virtual void emitEgress(CodeBuilder* builder);
+    // called from the module init and exit functions
+    virtual void emitProgramInit(CodeBuilder* builder);
+    virtual void emitProgramExit(CodeBuilder* builder);
     virtual void emitH(CodeBuilder* builder, cstring headerFile);  // emits C headers
     virtual void emitC(CodeBuilder* builder, cstring headerFile);  // emits C program
+    virtual void emitControlPlane(CodeBuilder* builder);  // emits the userspace C API
     WP4Control* getSwitch() const;
 };
 
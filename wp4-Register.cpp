@@ -0,0 +1,200 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#include "wp4-Register.h"
+#include "wp4-Type.h"
+#include "lib/error.h"
+
+namespace WP4 {
+
+WP4Register::WP4Register(const WP4Program* program, const IR::ExternBlock* block) :
+        program(program), block(block), size(0), valueType(nullptr), storage(Storage::Plain) {
+    auto di = block->node->to<IR::Declaration_Instance>();
+    BUG_CHECK(di != nullptr, "%1%: expected an instance", block->node);
+    instanceName = WP4Object::externalName(di);
+    auto& model = program->model.register_;
+
+    auto sz = block->getParameterValue(model.size.name)->to<IR::Constant>();
+    if (sz == nullptr || sz->value <= 0) {
+        ::error("%1%: register size must be a positive constant", di);
+        return;
+    }
+    size = sz->asUnsigned();
+
+    auto ts = di->type->to<IR::Type_Specialized>();
+    BUG_CHECK(ts != nullptr && ts->arguments->size() == 1, "%1%: expected one type argument", di);
+    valueType = program->typeMap->getTypeType(ts->arguments->at(0), true)->to<IR::Type_Bits>();
+    if (valueType == nullptr || valueType->size > 64) {
+        ::error("%1%: register values must be bit<N> or int<N> with N <= 64", di);
+        return;
+    }
+
+    bool atomic = di->getAnnotation(model.atomic.name) != nullptr;
+    bool perCpu = di->getAnnotation(model.perCpu.name) != nullptr;
+    if (atomic && perCpu)
+        ::error("%1%: a register cannot be both @%2% and @%3%", di,
+                model.atomic.name, model.perCpu.name);
+    else if (atomic)
+        storage = Storage::Atomic;
+    else if (perCpu)
+        storage = Storage::PerCpu;
+}
+
+void WP4Register::emitValueType(CodeBuilder* builder) {
+    WP4TypeFactory::instance->create(valueType)->emit(builder);
+}
+
+void WP4Register::emitInstance(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->append("static ");
+    switch (storage) {
+    case Storage::Plain:
+        emitValueType(builder);
+        builder->appendFormat(" %s[%u]", instanceName.c_str(), size);
+        break;
+    case Storage::Atomic:
+        builder->appendFormat("%s %s[%u]", wideAtomic() ? "atomic64_t" : "atomic_t",
+                              instanceName.c_str(), size);
+        break;
+    case Storage::PerCpu:
+        emitValueType(builder);
+        builder->appendFormat(" __percpu *%s", instanceName.c_str());
+        break;
+    }
+    builder->endOfStatement(true);
+}
+
+bool WP4Register::emitAllocation(CodeBuilder* builder, cstring failLabel) {
+    if (storage != Storage::PerCpu)
+        return false;
+    builder->emitIndent();
+    builder->appendFormat("%s = __alloc_percpu(%u * sizeof(*%s), __alignof__(*%s));",
+                          instanceName.c_str(), size, instanceName.c_str(), instanceName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("if (!%s) goto %s;", instanceName.c_str(), failLabel.c_str());
+    builder->newline();
+    return true;
+}
+
+void WP4Register::emitFree(CodeBuilder* builder) {
+    if (storage != Storage::PerCpu)
+        return;
+    builder->emitIndent();
+    builder->appendFormat("free_percpu(%s);", instanceName.c_str());
+    builder->newline();
+}
+
+void WP4Register::emitElement(CodeBuilder* builder, const IR::Expression* index,
+                              CodeGenInspector* codeGen) {
+    if (storage == Storage::Atomic)
+        builder->append("&");
+    builder->appendFormat("%s[", instanceName.c_str());
+    codeGen->emitMasked(index);
+    builder->append("]");
+}
+
+void WP4Register::emitMethodInvocation(CodeBuilder* builder, const P4::ExternMethod* method,
+                                       CodeGenInspector* codeGen) {
+    auto& model = program->model.register_;
+    auto args = method->expr->arguments;
+    auto index = args->at(0)->expression;
+    cstring name = method->method->name.name;
+    cstring prefix = wideAtomic() ? "atomic64_" : "atomic_";
+
+    if (name == model.read.name) {
+        // elements are machine words, so odd widths are truncated on read,
+        // and signed ones sign-extended from their top bit
+        bool odd = valueType->size != 8 && valueType->size != 16 &&
+                   valueType->size != 32 && valueType->size != 64;
+        bool mask = odd && !valueType->isSigned;
+        bool extend = odd && valueType->isSigned;
+        unsigned shift = 64 - valueType->size;
+        builder->append("(");
+        codeGen->emitMasked(index);
+        builder->appendFormat(" < %u ? ", size);
+        if (mask)
+            builder->append("(");
+        if (extend) {
+            builder->append("(");
+            emitValueType(builder);
+            builder->append(")((s64)((u64)(");
+        }
+        switch (storage) {
+        case Storage::Plain:
+            emitElement(builder, index, codeGen);
+            break;
+        case Storage::Atomic:
+            builder->append("(");
+            emitValueType(builder);
+            builder->appendFormat(")%sread(", prefix.c_str());
+            emitElement(builder, index, codeGen);
+            builder->append(")");
+            break;
+        case Storage::PerCpu:
+            builder->append("this_cpu_read(");
+            emitElement(builder, index, codeGen);
+            builder->append(")");
+            break;
+        }
+        if (mask)
+            builder->appendFormat(" & 0x%llxULL)", (1ULL << valueType->size) - 1);
+        if (extend)
+            builder->appendFormat(") << %u) >> %u)", shift, shift);
+        builder->append(" : 0)");
+        return;
+    }
+
+    bool isAdd = name == model.add.name;
+    BUG_CHECK(isAdd || name == model.write.name, "%1%: unexpected register method", method->expr);
+    auto value = args->at(1)->expression;
+    builder->emitIndent();
+    builder->append("if (");
+    codeGen->emitMasked(index);
+    builder->appendFormat(" < %u) ", size);
+    switch (storage) {
+    case Storage::Plain:
+        emitElement(builder, index, codeGen);
+        builder->append(isAdd ? " += " : " = ");
+        codeGen->visit(value);
+        break;
+    case Storage::Atomic:
+        // atomic_add takes the operand first, atomic_set the element
+        if (isAdd) {
+            builder->appendFormat("%sadd(", prefix.c_str());
+            codeGen->visit(value);
+            builder->append(", ");
+            emitElement(builder, index, codeGen);
+        } else {
+            builder->appendFormat("%sset(", prefix.c_str());
+            emitElement(builder, index, codeGen);
+            builder->append(", ");
+            codeGen->visit(value);
+        }
+        builder->append(")");
+        break;
+    case Storage::PerCpu:
+        builder->append(isAdd ? "this_cpu_add(" : "this_cpu_write(");
+        emitElement(builder, index, codeGen);
+        builder->append(", ");
+        codeGen->visit(value);
+        builder->append(")");
+        break;
+    }
+}
+
+}  // namespace WP4
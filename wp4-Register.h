@@ -0,0 +1,58 @@
+/*
+Copyright 2020 Paul Zanna.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#ifndef _BACKENDS_WP4_WP4REGISTER_H_
+#define _BACKENDS_WP4_WP4REGISTER_H_
+
+#include "wp4-Object.h"
+#include "wp4-Program.h"
+#include "frontends/p4/methodInstance.h"
+
+namespace WP4 {
+
+// An instance of the register extern.  Plain registers are a static array;
+// atomic registers an array of atomic_t or atomic64_t; per-CPU registers a
+// per-CPU array allocated when the module loads, accessed with this_cpu ops.
+class WP4Register : public WP4Object {
+ public:
+    enum class Storage { Plain, Atomic, PerCpu };
+
+    const WP4Program*      program;
+    const IR::ExternBlock* block;
+    cstring                instanceName;
+    unsigned               size;
+    const IR::Type_Bits*   valueType;
+    Storage                storage;
+
+    WP4Register(const WP4Program* program, const IR::ExternBlock* block);
+    void emitInstance(CodeBuilder* builder);
+    // per-CPU storage is allocated by the module; returns false if there is none
+    bool emitAllocation(CodeBuilder* builder, cstring failLabel);
+    void emitFree(CodeBuilder* builder);
+    void emitMethodInvocation(CodeBuilder* builder, const P4::ExternMethod* method,
+                              CodeGenInspector* codeGen);
+
+ private:
+    bool wideAtomic() const { return valueType->size > 32; }
+    void emitValueType(CodeBuilder* builder);
+    void emitElement(CodeBuilder* builder, const IR::Expression* index,
+                     CodeGenInspector* codeGen);
+};
+
+}  // namespace WP4
+
+#endif /* _BACKENDS_WP4_WP4REGISTER_H_ */
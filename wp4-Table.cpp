@@ -14,7 +14,10 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <algorithm>
+
 #include "wp4-Table.h"
+#include "wp4-Control.h"
 #include "wp4-Type.h"
 #include "ir/ir.h"
 #include "frontends/p4/coreLibrary.h"
@@ -23,17 +26,18 @@ limitations under the License.
 namespace WP4 {
 
 namespace {
-class ActionTranslationVisitor : public CodeGenInspector {
+// Action bodies are control code, so externs may be called from actions
+class ActionTranslationVisitor : public ControlBodyTranslator {
  protected:
     const WP4Program*  program;
     const IR::P4Action* action;
     cstring             valueName;
 
  public:
-    ActionTranslationVisitor(cstring valueName, const WP4Program* program):
-            CodeGenInspector(program->refMap, program->typeMap), program(program),
+    ActionTranslationVisitor(cstring valueName, const WP4Control* control):
+            ControlBodyTranslator(control), program(control->program),
             action(nullptr), valueName(valueName)
-    { CHECK_NULL(program); }
+    { setName("ActionTranslationVisitor"); }
 
     bool preorder(const IR::PathExpression* expression) {
         auto decl = program->refMap->getDeclaration(expression->path, true);
@@ -50,8 +54,7 @@ class ActionTranslationVisitor : public CodeGenInspector {
                 return false;
             }
         }
-        visit(expression->path);
-        return false;
+        return ControlBodyTranslator::preorder(expression);
     }
 
     bool preorder(const IR::P4Action* act) {
@@ -64,9 +67,10 @@ class ActionTranslationVisitor : public CodeGenInspector {
 
 ////////////////////////////////////////////////////////////////
 
-WP4Table::WP4Table(const WP4Program* program, const IR::TableBlock* table,
-                     CodeGenInspector* codeGen) :
-        WP4TableBase(program, WP4Object::externalName(table->container), codeGen), table(table) {
+WP4Table::WP4Table(const WP4Program* program, const WP4Control* control,
+                   const IR::TableBlock* table, CodeGenInspector* codeGen) :
+        WP4TableBase(program, WP4Object::externalName(table->container), codeGen),
+        table(table), control(control) {
     cstring base = instanceName + "_defaultAction";
     defaultActionMapName = program->refMap->newName(base);
 
@@ -75,6 +79,67 @@ WP4Table::WP4Table(const WP4Program* program, const IR::TableBlock* table,
 
     keyGenerator = table->container->getKey();
     actionList = table->container->getActionList();
+
+    flowField = WP4Model::reserved("flow");
+    counterName = directInstance(program->model.directCounter.counters.name,
+                                 program->model.directCounter.name);
+    meterName = directInstance(program->model.directMeter.meters.name,
+                               program->model.directMeter.name);
+
+    cuckooSize = 0;
+    entryTypeName = program->refMap->newName(instanceName + "_entry");
+    descriptorName = program->refMap->newName(instanceName + "_table");
+    updateTypeName = program->refMap->newName(instanceName + "_update");
+    auto impl = table->container->properties->getProperty(program->model.tableImplProperty.name);
+    auto implValue = impl == nullptr ? nullptr : impl->value->to<IR::ExpressionValue>();
+    if (implValue != nullptr) {
+        auto block = table->getValue(implValue->expression);
+        auto extblk = block == nullptr ? nullptr : block->to<IR::ExternBlock>();
+        if (extblk != nullptr && extblk->type->name == program->model.cuckoo_hash_table.name) {
+            auto sz = extblk->getParameterValue(program->model.cuckoo_hash_table.size.name);
+            if (sz == nullptr || !sz->is<IR::Constant>() || sz->to<IR::Constant>()->value <= 0)
+                ::error("%1%: expected a positive table size", impl);
+            else if (keyGenerator == nullptr)
+                ::error("%1%: a table without a key cannot be hashed", impl);
+            else
+                cuckooSize = sz->to<IR::Constant>()->asUnsigned();
+        }
+    }
+    if (cuckooSize == 0 && keyGenerator != nullptr)
+        ::warning(ErrorType::WARN_UNSUPPORTED,
+                  "%1%: entries are only kept by the module for a %2% implementation; "
+                  "the control plane can only set the default action", table->container,
+                  program->model.cuckoo_hash_table.name);
+
+    idleTimeout = 0;
+    lastHitField = WP4Model::reserved("last_hit");
+    auto prop = table->container->properties->getProperty(program->model.idleTimeoutProperty.name);
+    if (prop != nullptr) {
+        auto ev = prop->value->to<IR::ExpressionValue>();
+        auto timeout = ev == nullptr ? nullptr : ev->expression->to<IR::Constant>();
+        if (timeout == nullptr || timeout->value <= 0)
+            ::error("%1%: expected a positive number of milliseconds", prop);
+        else if (keyGenerator == nullptr)
+            ::error("%1%: a table without a key has no entries to age", prop);
+        else if (cuckooSize == 0)
+            // only the cuckoo tables keep entries, and stamp them
+            ::error("%1%: requires a %2% implementation", prop, program->model.cuckoo_hash_table.name);
+        else
+            idleTimeout = timeout->asUnsigned();
+    }
+}
+
+cstring WP4Table::directInstance(cstring property, cstring externName) const {
+    auto prop = table->container->properties->getProperty(property);
+    if (prop == nullptr)
+        return nullptr;
+    auto ev = prop->value->to<IR::ExpressionValue>();
+    auto pe = ev == nullptr ? nullptr : ev->expression->to<IR::PathExpression>();
+    if (pe == nullptr) {
+        ::error("%1%: expected the name of a %2% instance", prop, externName);
+        return nullptr;
+    }
+    return program->refMap->getDeclaration(pe->path, true)->getName();
 }
 
 void WP4Table::emitKeyType(CodeBuilder* builder) {
@@ -176,6 +241,17 @@ void WP4Table::emitValueType(CodeBuilder* builder) {
     builder->emitIndent();
     builder->appendFormat("enum %s action;", actionEnumName.c_str());
     builder->newline();
+    if (hasFlowField()) {
+        // index of the direct counter and meter elements, set by the control plane
+        builder->emitIndent();
+        builder->appendFormat("u32 %s;", flowField.c_str());
+        builder->newline();
+    }
+    if (idleTimeout != 0) {
+        builder->emitIndent();
+        builder->appendFormat("unsigned long %s;", lastHitField.c_str());
+        builder->newline();
+    }
 
     builder->emitIndent();
     builder->append("union ");
@@ -198,6 +274,226 @@ void WP4Table::emitValueType(CodeBuilder* builder) {
 void WP4Table::emitTypes(CodeBuilder* builder) {
     emitKeyType(builder);
     emitValueType(builder);
+
+    // a control-plane operation, WP4_TABLE_*
+    builder->emitIndent();
+    builder->appendFormat("struct %s ", updateTypeName.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendLine("u32 op;");
+    builder->emitIndent();
+    builder->appendFormat("struct %s key;", keyTypeName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("struct %s value;", valueTypeName.c_str());
+    builder->newline();
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+
+    if (cuckooSize == 0)
+        return;
+    builder->emitIndent();
+    builder->appendFormat("struct %s ", entryTypeName.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("struct %s key;", keyTypeName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("struct %s value;", valueTypeName.c_str());
+    builder->newline();
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+}
+
+void WP4Table::emitLookup(CodeBuilder* builder, cstring keyName, cstring valueName) {
+    builder->emitIndent();
+    if (cuckooSize == 0) {
+        builder->target->emitTableLookup(builder, dataMapName, keyName, valueName);
+        builder->endOfStatement(true);
+        return;
+    }
+    // the value, or on a miss the default action, is copied out, so that
+    // entries can move while it is used
+    cstring copy = valueName + "_copy";
+    builder->appendFormat("struct %s %s;", valueTypeName.c_str(), copy.c_str());
+    builder->newline();
+    // an aging table restamps the entry where the lookup found it
+    cstring index = "NULL";
+    if (idleTimeout != 0) {
+        index = "&" + valueName + "_index";
+        builder->emitIndent();
+        builder->appendFormat("u32 %s_index;", valueName.c_str());
+        builder->newline();
+    }
+    builder->emitIndent();
+    builder->appendFormat("%s = wp4_table_lookup(&%s, &%s, sizeof(%s), &%s, &%s_default, sizeof(%s), %s) ? "
+                          "&%s : NULL;", valueName.c_str(), descriptorName.c_str(), keyName.c_str(),
+                          keyName.c_str(), copy.c_str(), valueName.c_str(), copy.c_str(),
+                          index.c_str(), copy.c_str());
+    builder->newline();
+}
+
+// On a miss the default action is copied out, so that the control plane
+// can replace it while the copy is used.  A cuckoo table lookup has copied
+// it already.
+void WP4Table::emitDefaultLookup(CodeBuilder* builder, cstring valueName) {
+    cstring copy = valueName + "_default";
+    if (cuckooSize == 0) {
+        builder->emitIndent();
+        builder->appendFormat("wp4_table_default(&%s, &%s, sizeof(%s));", descriptorName.c_str(),
+                              copy.c_str(), copy.c_str());
+        builder->newline();
+    }
+    builder->emitIndent();
+    builder->appendFormat("%s = &%s", valueName.c_str(), copy.c_str());
+    builder->endOfStatement(true);
+}
+
+void WP4Table::emitInstance(CodeBuilder* builder) {
+    if (cuckooSize != 0) {
+        builder->emitIndent();
+        builder->appendFormat("static struct wp4_cuckoo %s;", dataMapName.c_str());
+        builder->newline();
+    }
+    builder->emitIndent();
+    builder->appendFormat("static struct %s %s = ", valueTypeName.c_str(), defaultActionMapName.c_str());
+    emitActionValue(builder, table->container->getDefaultAction());
+    builder->endOfStatement(true);
+
+    builder->emitIndent();
+    builder->appendFormat("static struct wp4_table %s = ", descriptorName.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat(".entries = %s,", cuckooSize != 0 ? ("&" + dataMapName).c_str() : "NULL");
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat(".default_value = (u8 *)&%s,", defaultActionMapName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat(".value_size = sizeof(struct %s),", valueTypeName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat(".key_offset = offsetof(struct %s, key),", updateTypeName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat(".value_offset = offsetof(struct %s, value),", updateTypeName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat(".record_size = sizeof(struct %s),", updateTypeName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat(".invalidate = %s,",
+                          program->flowCache != nullptr ? "wp4_flow_cache_invalidate" : "NULL");
+    builder->newline();
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+}
+
+// { .action = ..., .u = { ... } } for a call of one of the table's actions
+void WP4Table::emitActionValue(CodeBuilder* builder, const IR::Expression* actionCall) {
+    BUG_CHECK(actionCall->is<IR::MethodCallExpression>(), "%1%: expected an action call", actionCall);
+    auto mce = actionCall->to<IR::MethodCallExpression>();
+    auto mi = P4::MethodInstance::resolve(mce, program->refMap, program->typeMap);
+    auto ac = mi->to<P4::ActionCall>();
+    BUG_CHECK(ac != nullptr, "%1%: expected an action call", mce);
+    cstring name = WP4Object::externalName(ac->action);
+
+    CodeGenInspector cg(program->refMap, program->typeMap);
+    cg.setBuilder(builder);
+    builder->appendFormat("{ .action = %s, .u = { .%s = { ", name.c_str(), name.c_str());
+    for (auto p : *mi->substitution.getParametersInArgumentOrder()) {
+        mi->substitution.lookup(p)->apply(cg);
+        builder->append(", ");
+    }
+    builder->append("} } }");
+}
+
+// The const entries of the table, inserted when the module loads
+void WP4Table::emitEntries(CodeBuilder* builder, cstring failLabel) {
+    auto entries = table->container->getEntries();
+    if (entries == nullptr)
+        return;
+    if (cuckooSize == 0) {
+        ::warning(ErrorType::WARN_UNSUPPORTED, "%1%: const entries ignored without a %2% implementation",
+                  entries, program->model.cuckoo_hash_table.name);
+        return;
+    }
+    CodeGenInspector cg(program->refMap, program->typeMap);
+    cg.setBuilder(builder);
+    cstring key = WP4Model::reserved("key");
+    cstring value = WP4Model::reserved("value");
+    for (auto e : entries->entries) {
+        builder->emitIndent();
+        builder->blockStart();
+        builder->emitIndent();
+        builder->appendFormat("struct %s %s = {};", keyTypeName.c_str(), key.c_str());
+        builder->newline();
+        // the key fields are ordered by size, not as the key elements
+        auto values = e->getKeys()->components;
+        for (size_t i = 0; i < values.size(); i++) {
+            auto c = keyGenerator->keyElements.at(i);
+            auto scalar = ::get(keyTypes, c)->to<WP4ScalarType>();
+            cstring fieldName = ::get(keyFieldNames, c);
+            if (!values.at(i)->is<IR::Constant>() || scalar == nullptr ||
+                !WP4ScalarType::generatesScalar(scalar->implementationWidthInBits())) {
+                ::error("%1%: only constant keys of at most 64 bits "
+                        "are supported in const entries", values.at(i));
+                return;
+            }
+            builder->emitIndent();
+            builder->appendFormat("%s.%s = ", key.c_str(), fieldName.c_str());
+            values.at(i)->apply(cg);
+            builder->endOfStatement(true);
+        }
+        builder->emitIndent();
+        builder->appendFormat("struct %s %s = ", valueTypeName.c_str(), value.c_str());
+        emitActionValue(builder, e->getAction());
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("if (wp4_cuckoo_insert(&%s, &%s, &%s)) goto %s;", dataMapName.c_str(),
+                              key.c_str(), value.c_str(), failLabel.c_str());
+        builder->newline();
+        builder->blockEnd(true);
+    }
+}
+
+bool WP4Table::emitAllocation(CodeBuilder* builder, cstring dirName, cstring failLabel) {
+    builder->emitIndent();
+    builder->appendFormat("wp4_table_init(&%s);", descriptorName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("debugfs_create_file(\"%s\", 0600, %s, &%s, &wp4_table_fops);",
+                          instanceName.c_str(), dirName.c_str(), descriptorName.c_str());
+    builder->newline();
+    if (cuckooSize == 0)
+        return false;
+    builder->emitIndent();
+    builder->appendFormat("if (wp4_cuckoo_init(&%s, %u, sizeof(struct %s), offsetof(struct %s, value), "
+                          "sizeof(struct %s), sizeof(struct %s))) goto %s;",
+                          dataMapName.c_str(), cuckooSize, keyTypeName.c_str(), entryTypeName.c_str(),
+                          valueTypeName.c_str(), entryTypeName.c_str(), failLabel.c_str());
+    builder->newline();
+    if (idleTimeout != 0) {
+        builder->emitIndent();
+        builder->appendFormat("wp4_cuckoo_set_aging(&%s, offsetof(struct %s, value.%s), %u);",
+                              dataMapName.c_str(), entryTypeName.c_str(), lastHitField.c_str(),
+                              idleTimeout);
+        builder->newline();
+    }
+    emitEntries(builder, failLabel);
+    return true;
+}
+
+void WP4Table::emitFree(CodeBuilder* builder) {
+    if (cuckooSize == 0)
+        return;
+    // a replacement that was not committed
+    builder->emitIndent();
+    builder->appendFormat("wp4_table_free(&%s);", descriptorName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("wp4_cuckoo_free(&%s);", dataMapName.c_str());
+    builder->newline();
 }
 
 void WP4Table::emitKey(CodeBuilder* builder, cstring keyName) {
@@ -223,29 +519,77 @@ void WP4Table::emitKey(CodeBuilder* builder, cstring keyName) {
             builder->appendFormat(", %d)", scalar->bytesRequired());
         } else {
             builder->appendFormat("%s.%s = ", keyName.c_str(), fieldName.c_str());
-            codeGen->visit(c->expression);
+            codeGen->emitMasked(c->expression);
         }
         builder->endOfStatement(true);
     }
 }
 
-void WP4Table::emitAction(CodeBuilder* builder, cstring valueName) {
+// Expiry is lazy: see wp4_cuckoo_touch
+void WP4Table::emitIdleExpiry(CodeBuilder* builder, cstring keyName, cstring valueName) {
+    if (idleTimeout == 0)
+        return;
     builder->emitIndent();
-    builder->appendFormat("switch (%s->action) ", valueName.c_str());
+    builder->appendFormat("if (%s != NULL && !wp4_cuckoo_touch(&%s, &%s, sizeof(%s), %s_index, %s->%s)) ",
+                          valueName.c_str(), dataMapName.c_str(), keyName.c_str(), keyName.c_str(),
+                          valueName.c_str(), valueName.c_str(), lastHitField.c_str());
     builder->blockStart();
+    // a miss after all, for which the lookup did not copy the default action
+    builder->emitIndent();
+    builder->appendFormat("wp4_table_default(&%s, &%s_default, sizeof(%s_default));",
+                          descriptorName.c_str(), valueName.c_str(), valueName.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("%s = NULL", valueName.c_str());
+    builder->endOfStatement(true);
+    builder->blockEnd(true);
+}
 
+void WP4Table::emitAction(CodeBuilder* builder, cstring valueName) {
+    auto profile = program->profile;
+    std::vector<const IR::P4Action*> actions;
     for (auto a : actionList->actionList) {
         auto adecl = program->refMap->getDeclaration(a->getPath(), true);
-        auto action = adecl->getNode()->to<IR::P4Action>();
+        actions.push_back(adecl->getNode()->to<IR::P4Action>());
+    }
+    // frequent actions first
+    std::stable_sort(actions.begin(), actions.end(),
+        [this, profile](const IR::P4Action* a, const IR::P4Action* b) {
+            return profile->count(WP4Profile::action(instanceName, WP4Object::externalName(a))) >
+                   profile->count(WP4Profile::action(instanceName, WP4Object::externalName(b))); });
+
+    if (!counterName.isNullOrEmpty()) {
+        // a miss runs the default action, which is no entry's to bill
+        builder->emitIndent();
+        builder->appendFormat("if (%s) ", control->hitVariable.c_str());
+        builder->blockStart();
+        control->getCounter(counterName)->emitCount(builder, valueName + "->" + flowField);
+        builder->blockEnd(true);
+    }
+
+    builder->emitIndent();
+    builder->appendFormat("switch (%s->action) ", valueName.c_str());
+    builder->blockStart();
+
+    for (auto action : actions) {
         builder->emitIndent();
         cstring name = WP4Object::externalName(action);
         builder->appendFormat("case %s: ", name.c_str());
         builder->newline();
+        cstring count = profile->increment(WP4Profile::action(instanceName, name));
+        if (!count.isNullOrEmpty()) {
+            builder->emitIndent();
+            builder->appendLine(count);
+        }
         builder->emitIndent();
 
-        ActionTranslationVisitor visitor(valueName, program);
+        ActionTranslationVisitor visitor(valueName, control);
         visitor.setBuilder(builder);
         visitor.copySubstitutions(codeGen);
+        if (!meterName.isNullOrEmpty()) {
+            visitor.directMeter = meterName;
+            visitor.entryIndex = valueName + "->" + flowField;
+        }
 
         action->apply(visitor);
         builder->newline();
@@ -260,124 +604,143 @@ void WP4Table::emitAction(CodeBuilder* builder, cstring valueName) {
     builder->blockEnd(true);
 }
 
-void WP4Table::emitInitializer(CodeBuilder* builder) {
-    // emit code to initialize the default action
-    const IR::P4Table* t = table->container;
-    const IR::Expression* defaultAction = t->getDefaultAction();
-    BUG_CHECK(defaultAction->is<IR::MethodCallExpression>(),
-              "%1%: expected an action call", defaultAction);
-    auto mce = defaultAction->to<IR::MethodCallExpression>();
-    auto mi = P4::MethodInstance::resolve(mce, program->refMap, program->typeMap);
+void WP4Table::emitControlPlane(CodeBuilder* builder) {
+    cstring t = instanceName;
+    cstring update = "struct " + updateTypeName;
+    cstring key = "const struct " + keyTypeName + " *key";
+    cstring value = "const struct " + valueTypeName + " *value";
 
-    auto ac = mi->to<P4::ActionCall>();
-    BUG_CHECK(ac != nullptr, "%1%: expected an action call", mce);
-    auto action = ac->action;
-    cstring name = WP4Object::externalName(action);
-    cstring fd = "tableFileDescriptor";
-    cstring defaultTable = defaultActionMapName;
-    cstring value = "value";
-    cstring key = "key";
-
-    builder->emitIndent();
-    builder->blockStart();
-    builder->emitIndent();
-    builder->appendFormat("int %s = BPF_OBJ_GET(MAP_PATH \"/%s\")", fd.c_str(), defaultTable.c_str());
-    builder->endOfStatement(true);
-    builder->emitIndent();
-    builder->appendFormat("if (%s < 0) { fprintf(stderr, \"map %s not loaded\\n\"); exit(1); }", fd.c_str(), defaultTable.c_str());
+    builder->appendFormat("/* %s: %s */", t.c_str(),
+                          cuckooSize != 0 ? "entries and default action" : "default action only");
     builder->newline();
-
-    builder->emitIndent();
-    builder->appendFormat("struct %s %s = ", valueTypeName.c_str(), value.c_str());
+    builder->appendFormat("static inline int %s_open(void) ", t.c_str());
     builder->blockStart();
     builder->emitIndent();
-    builder->appendFormat(".action = %s,", name.c_str());
+    builder->appendFormat("return open(WP4_TABLES_DIR \"/%s\", O_RDWR);", t.c_str());
+    builder->newline();
+    builder->blockEnd(true);
     builder->newline();
 
-    CodeGenInspector cg(program->refMap, program->typeMap);
-    cg.setBuilder(builder);
-
-    builder->emitIndent();
-    builder->appendFormat(".u = {.%s = {", name.c_str());
-    for (auto p : *mi->substitution.getParametersInArgumentOrder()) {
-        auto arg = mi->substitution.lookup(p);
-        arg->apply(cg);
-        builder->append(",");
-    }
-    builder->append("}},\n");
-
-    builder->blockEnd(false);
-    builder->endOfStatement(true);
-
+    builder->appendLine("/* Applies the updates in order with one write, up to the first that fails;");
+    builder->appendLine("   the ones before it stay applied, and their number is returned in");
+    builder->appendLine("   *applied.  Returns 0 or the -errno of the update that failed */");
+    builder->appendFormat("static inline int %s_apply(int fd, const %s *updates, size_t n, size_t *applied) ",
+                          t.c_str(), update.c_str());
+    builder->blockStart();
     builder->emitIndent();
-    builder->appendFormat("if (ok != 0) { perror(\"Could not write in %s\"); exit(1); }",
-                          defaultTable.c_str());
-    builder->newline();
+    builder->appendLine("return wp4_ctl_write(fd, updates, sizeof(*updates), n, applied);");
     builder->blockEnd(true);
+    builder->newline();
 
-    // Emit code for table initializer
-    auto entries = t->getEntries();
-
-    if (entries == nullptr)
-        return;
-
-    builder->emitIndent();
+    builder->appendLine("/* Applies the updates as one transaction: lookups see either none or all");
+    builder->appendLine("   of them.  Returns 0, or -errno and the index of the update that failed */");
+    builder->appendFormat("static inline int %s_batch(int fd, const %s *updates, size_t n, size_t *failed) ",
+                          t.c_str(), update.c_str());
     builder->blockStart();
     builder->emitIndent();
-    builder->appendFormat("int %s = BPF_OBJ_GET(MAP_PATH \"/%s\")", fd.c_str(), dataMapName.c_str());
-    builder->endOfStatement(true);
-    builder->emitIndent();
-    builder->appendFormat("if (%s < 0) { fprintf(stderr, \"map %s not loaded\\n\"); exit(1); }", fd.c_str(), dataMapName.c_str());
+    builder->appendLine("return wp4_ctl_batch(fd, updates, n, failed);");
+    builder->blockEnd(true);
     builder->newline();
 
-    for (auto e : entries->entries) {
-        builder->emitIndent();
-        builder->blockStart();
-
-        auto entryAction = e->getAction();
-        builder->emitIndent();
-        builder->appendFormat("struct %s %s = {", keyTypeName.c_str(), key.c_str());
-        e->getKeys()->apply(cg);
-        builder->append("}");
-        builder->endOfStatement(true);
-
-        BUG_CHECK(entryAction->is<IR::MethodCallExpression>(), "%1%: expected an action call", defaultAction);
-        auto mce = entryAction->to<IR::MethodCallExpression>();
-        auto mi = P4::MethodInstance::resolve(mce, program->refMap, program->typeMap);
-
-        auto ac = mi->to<P4::ActionCall>();
-        BUG_CHECK(ac != nullptr, "%1%: expected an action call", mce);
-        auto action = ac->action;
-        cstring name = WP4Object::externalName(action);
+    if (cuckooSize != 0) {
+        builder->appendLine("/* Full replacement: after _shadow the updates fill an empty copy of the");
+        builder->appendLine("   table, which replaces it on _commit; lookups never see it half filled */");
+        struct { const char* name; const char* cmd; } replace[] = {
+            { "shadow", "WP4_TABLE_IOC_SHADOW" },
+            { "commit", "WP4_TABLE_IOC_COMMIT" },
+            { "abort", "WP4_TABLE_IOC_ABORT" },
+        };
+        for (auto& r : replace) {
+            builder->appendFormat("static inline int %s_%s(int fd) ", t.c_str(), r.name);
+            builder->blockStart();
+            builder->emitIndent();
+            builder->appendFormat("return ioctl(fd, %s) < 0 ? -errno : 0;", r.cmd);
+            builder->newline();
+            builder->blockEnd(true);
+            builder->newline();
+        }
+    }
 
-        builder->emitIndent();
-        builder->appendFormat("struct %s %s = ", valueTypeName.c_str(), value.c_str());
+    struct { const char* name; const char* op; bool hasKey, hasValue; } ops[] = {
+        { "add", "WP4_TABLE_ADD", true, true },
+        { "modify", "WP4_TABLE_MODIFY", true, true },
+        { "delete", "WP4_TABLE_DELETE", true, false },
+        { "set_default", "WP4_TABLE_SET_DEFAULT", false, true },
+    };
+    for (auto& op : ops) {
+        builder->appendFormat("static inline int %s_%s(int fd", t.c_str(), op.name);
+        if (op.hasKey)
+            builder->appendFormat(", %s", key.c_str());
+        if (op.hasValue)
+            builder->appendFormat(", %s", value.c_str());
+        builder->append(") ");
         builder->blockStart();
         builder->emitIndent();
-        builder->appendFormat(".action = %s,", name.c_str());
+        builder->appendFormat("%s u = { .op = %s", update.c_str(), op.op);
+        if (op.hasKey)
+            builder->append(", .key = *key");
+        if (op.hasValue)
+            builder->append(", .value = *value");
+        builder->append(" };");
         builder->newline();
-
-        CodeGenInspector cg(program->refMap, program->typeMap);
-        cg.setBuilder(builder);
-
         builder->emitIndent();
-        builder->appendFormat(".u = {.%s = {", name.c_str());
-        for (auto p : *mi->substitution.getParametersInArgumentOrder()) {
-            auto arg = mi->substitution.lookup(p);
-            arg->apply(cg);
-            builder->append(",");
-        }
-        builder->append("}},\n");
-
-        builder->blockEnd(false);
-        builder->endOfStatement(true);
-
-        builder->emitIndent();
-        builder->appendFormat("if (ok != 0) { perror(\"Could not write in %s\"); exit(1); }", t->name.name.c_str());
+        builder->appendFormat("return %s_apply(fd, &u, 1, NULL);", t.c_str());
         builder->newline();
         builder->blockEnd(true);
+        builder->newline();
     }
+
+    builder->appendFormat("static inline int %s_bulk_add(int fd, const struct %s *keys, "
+                          "const struct %s *values, size_t n) ",
+                          t.c_str(), keyTypeName.c_str(), valueTypeName.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("%s *u;", update.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendLine("size_t i;");
+    builder->emitIndent();
+    builder->appendLine("int err;");
+    builder->newline();
+    builder->emitIndent();
+    builder->appendLine("if (n == 0)");
+    builder->emitIndent();
+    builder->appendLine("    return 0;");
+    builder->emitIndent();
+    builder->appendLine("u = calloc(n, sizeof(*u));");
+    builder->emitIndent();
+    builder->appendLine("if (u == NULL)");
+    builder->emitIndent();
+    builder->appendLine("    return -ENOMEM;");
+    builder->emitIndent();
+    builder->appendLine("for (i = 0; i < n; i++) {");
+    builder->emitIndent();
+    builder->appendLine("    u[i].op = WP4_TABLE_ADD;");
+    builder->emitIndent();
+    builder->appendLine("    u[i].key = keys[i];");
+    builder->emitIndent();
+    builder->appendLine("    u[i].value = values[i];");
+    builder->emitIndent();
+    builder->appendLine("}");
+    builder->emitIndent();
+    builder->appendFormat("err = %s_batch(fd, u, n, NULL);", t.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendLine("free(u);");
+    builder->emitIndent();
+    builder->appendLine("return err;");
     builder->blockEnd(true);
+    builder->newline();
+
+    builder->appendLine("/* Reads the default action (WP4_TABLE_SET_DEFAULT) and the entries");
+    builder->appendLine("   (WP4_TABLE_ADD); returns how many, at most max, or -errno */");
+    builder->appendFormat("static inline ssize_t %s_read(int fd, %s *updates, size_t max) ",
+                          t.c_str(), update.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendLine("return wp4_ctl_read(fd, updates, sizeof(*updates), max);");
+    builder->blockEnd(true);
+    builder->newline();
 }
 
 }  // namespace WP4
@@ -22,6 +22,9 @@ limitations under the License.
 #include "frontends/p4/methodInstance.h"
 
 namespace WP4 {
+
+class WP4Control;
+
 class WP4TableBase : public WP4Object {
  public:
     const WP4Program* program;
@@ -48,19 +51,50 @@ class WP4Table final : public WP4TableBase {
     const IR::Key*            keyGenerator;
     const IR::ActionList*     actionList;
     const IR::TableBlock*    table;
+    const WP4Control*        control;
     cstring               defaultActionMapName;
     cstring               actionEnumName;
+    // direct_counter and direct_meter named by the 'counters' and 'meters'
+    // properties, both indexed by flowField
+    cstring               counterName;
+    cstring               meterName;
+    cstring               flowField;
+    // idle_timeout property in milliseconds, 0 if entries do not age
+    unsigned              idleTimeout;
+    cstring               lastHitField;
+    // entries of a cuckoo_hash_table implementation, 0 for other tables
+    unsigned              cuckooSize;
+    cstring               entryTypeName;
+    // the struct wp4_table through which the control plane updates the
+    // table, with records of updateTypeName
+    cstring               descriptorName;
+    cstring               updateTypeName;
     std::map<const IR::KeyElement*, cstring> keyFieldNames;
     std::map<const IR::KeyElement*, WP4Type*> keyTypes;
 
-    WP4Table(const WP4Program* program, const IR::TableBlock* table, CodeGenInspector* codeGen);
+    WP4Table(const WP4Program* program, const WP4Control* control,
+             const IR::TableBlock* table, CodeGenInspector* codeGen);
     void emitTypes(CodeBuilder* builder);
     void emitActionArguments(CodeBuilder* builder, const IR::P4Action* action, cstring name);
     void emitKeyType(CodeBuilder* builder);
     void emitValueType(CodeBuilder* builder);
     void emitKey(CodeBuilder* builder, cstring keyName);
     void emitAction(CodeBuilder* builder, cstring valueName);
-    void emitInitializer(CodeBuilder* builder);
+    void emitIdleExpiry(CodeBuilder* builder, cstring keyName, cstring valueName);
+    void emitLookup(CodeBuilder* builder, cstring keyName, cstring valueName);
+    void emitDefaultLookup(CodeBuilder* builder, cstring valueName);
+    void emitInstance(CodeBuilder* builder);
+    bool emitAllocation(CodeBuilder* builder, cstring dirName, cstring failLabel);
+    void emitFree(CodeBuilder* builder);
+    // the userspace functions of the generated control-plane header
+    void emitControlPlane(CodeBuilder* builder);
+    bool hasFlowField() const
+    { return !counterName.isNullOrEmpty() || !meterName.isNullOrEmpty(); }
+
+ private:
+    cstring directInstance(cstring property, cstring externName) const;
+    void emitActionValue(CodeBuilder* builder, const IR::Expression* actionCall);
+    void emitEntries(CodeBuilder* builder, cstring failLabel);
 };
 
 }  // namespace WP4
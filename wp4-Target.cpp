@@ -36,25 +36,41 @@ void wp4Target::emitIncludes(Util::SourceCodeBuilder* builder) const {
          "#include <linux/mm.h>\n"  
          "#include <linux/skbuff.h>\n"
          "#include <linux/netdevice.h>\n"
+         "#include <linux/jiffies.h>\n"
+         "#include <linux/jhash.h>\n"
+         "#include <asm/unaligned.h>\n"
          "#include \"wp4_runtime.h\"\n"
          "\n");
 }
 
+void wp4Target::emitTransmitHook(Util::SourceCodeBuilder* builder) const {
+     builder->append(
+         "static wp4_xmit_t wp4_xmit;\n"
+         "\n"
+         "/* The driver's function that transmits on a port, or NULL */\n"
+         "void wp4_set_xmit(wp4_xmit_t xmit) {\n"
+         "   WRITE_ONCE(wp4_xmit, xmit);\n"
+         "}\n"
+         "EXPORT_SYMBOL(wp4_set_xmit);\n"
+         "\n");
+}
+
 void wp4Target::emitModule(Util::SourceCodeBuilder* builder) const {
      builder->append(
          "static int __init wp4_init(void) {\n"
          "   printk(KERN_INFO \"WP4: Loading WP4 LKM!\\n\");\n"
-         "   return 0;\n"
+         "   return wp4_program_init();\n"
          "}\n"
          "\n"
          "static void __exit wp4_exit(void) {\n"
+         "   wp4_program_exit();\n"
          "   printk(KERN_INFO \"WP4: Removing WP4 LKM!\\n\");\n"
          "}\n"
          "\n");
 }
 
-void wp4Target::emitMain(Util::SourceCodeBuilder* builder, cstring functionName, cstring argName, cstring packetSize) const {
-     builder->appendFormat("int %s(u8 *%s, u16 %s, u8 port)", functionName.c_str(), argName.c_str(), packetSize);
+void wp4Target::emitMain(Util::SourceCodeBuilder* builder, cstring functionName, cstring argName) const {
+     builder->appendFormat("int %s(struct sk_buff *%s, u32 port)", functionName.c_str(), argName.c_str());
 }
 
 }  // namespace WP4
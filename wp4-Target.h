@@ -39,8 +39,9 @@ class Target {
     virtual void emitCodeSection(Util::SourceCodeBuilder* builder, cstring sectionName) const = 0;
     virtual void emitIncludes(Util::SourceCodeBuilder* builder) const = 0;
     virtual void emitModule(Util::SourceCodeBuilder* builder) const = 0;
+    virtual void emitTransmitHook(Util::SourceCodeBuilder* builder) const = 0;
     virtual void emitTableLookup(Util::SourceCodeBuilder* builder, cstring tblName, cstring key, cstring value) const = 0;
-    virtual void emitMain(Util::SourceCodeBuilder* builder, cstring functionName, cstring argName, cstring packetSize) const = 0;
+    virtual void emitMain(Util::SourceCodeBuilder* builder, cstring functionName, cstring argName) const = 0;
     virtual cstring dataOffset(cstring base) const = 0;
     virtual cstring dataEnd(cstring base) const = 0;
     virtual cstring forwardReturnCode() const = 0;
@@ -56,8 +57,9 @@ class wp4Target : public Target {
     void emitCodeSection(Util::SourceCodeBuilder*, cstring) const override {}
     void emitIncludes(Util::SourceCodeBuilder* builder) const override;
     void emitModule(Util::SourceCodeBuilder* builder) const override;
+    void emitTransmitHook(Util::SourceCodeBuilder* builder) const override;
     void emitTableLookup(Util::SourceCodeBuilder* builder, cstring tblName, cstring key, cstring value) const override;
-    void emitMain(Util::SourceCodeBuilder* builder, cstring functionName, cstring argName, cstring packetSize) const override;
+    void emitMain(Util::SourceCodeBuilder* builder, cstring functionName, cstring argName) const override;
     cstring dataOffset(cstring base) const override { return base; }
     cstring dataEnd(cstring base) const override
     { return cstring("(") + base + " + " + base + "->len)"; }
@@ -15,6 +15,7 @@ limitations under the License.
 */
 
 #include "wp4-Type.h"
+#include "wp4-DeadFields.h"
 
 namespace WP4 {
 
@@ -41,6 +42,8 @@ WP4Type* WP4TypeFactory::create(const IR::Type* type) {
         result = new WP4TypeName(tn, result);
     } else if (auto te = type->to<IR::Type_Enum>()) {
         result = new WP4EnumType(te);
+    } else if (auto vt = type->to<IR::Type_Varbits>()) {
+        result = new WP4VarbitType(vt);
     } else if (auto ts = type->to<IR::Type_Stack>()) {
         auto et = create(ts->elementType);
         if (et == nullptr)
@@ -87,6 +90,15 @@ unsigned WP4StackType::implementationWidthInBits() {
 
 /////////////////////////////////////////////////////////////
 
+void WP4VarbitType::declare(CodeBuilder* builder, cstring id, bool asPointer) {
+    if (asPointer)
+        builder->appendFormat("u8* %s", id.c_str());
+    else
+        builder->appendFormat("u8 %s[%d]", id.c_str(), ROUNDUP(maxWidth, 8));
+}
+
+/////////////////////////////////////////////////////////////
+
 unsigned WP4ScalarType::alignment() const {
     if (width <= 8)
         return 1;
@@ -155,7 +167,8 @@ WP4StructType::WP4StructType(const IR::Type_StructLike* strct) :
             ::error("WP4: Unsupported type in struct: %s", f->type);
         } else {
             width += wt->widthInBits();
-            implWidth += wt->implementationWidthInBits();
+            if (!EliminateDeadFields::isDead(f))
+                implWidth += wt->implementationWidthInBits();
         }
         fields.push_back(new WP4Field(type, f));
     }
@@ -181,7 +194,10 @@ void WP4StructType::emitInitializer(CodeBuilder* builder) {
         }
     } else if (type->is<IR::Type_Header>()) {
         builder->emitIndent();
-        builder->appendLine(".wp4_valid = 0");
+        builder->appendLine(".wp4_valid = 0,");
+        // not extracted: never in place in the output packet
+        builder->emitIndent();
+        builder->appendLine(".wp4_offset = 0xffff");
     } else {
         BUG("Unexpected type %1%", type);
     }
@@ -197,6 +213,9 @@ void WP4StructType::emit(CodeBuilder* builder) {
     builder->blockStart();
 
     for (auto f : fields) {
+        // no storage for fields which are never read
+        if (EliminateDeadFields::isDead(f->field))
+            continue;
         auto type = f->type;
         builder->emitIndent();
 
@@ -210,6 +229,11 @@ void WP4StructType::emit(CodeBuilder* builder) {
         }
         builder->append(" */");
         builder->newline();
+        if (type->is<WP4StackType>()) {
+            builder->emitIndent();
+            builder->appendFormat("u8 %s", WP4StackType::nextIndex(f->field->name).c_str());
+            builder->endOfStatement(true);
+        }
     }
 
     if (type->is<IR::Type_Header>()) {
@@ -219,6 +243,18 @@ void WP4StructType::emit(CodeBuilder* builder) {
             type->declare(builder, "wp4_valid", false);
             builder->endOfStatement(true);
         }
+        // bit offset at which the header was extracted
+        builder->emitIndent();
+        builder->append("u16 wp4_offset");
+        builder->endOfStatement(true);
+        for (auto f : fields) {
+            if (f->type->is<WP4VarbitType>()) {
+                // bits in the varbit field
+                builder->emitIndent();
+                builder->appendFormat("u16 %s", WP4VarbitType::lengthField().c_str());
+                builder->endOfStatement(true);
+            }
+        }
     }
 
     builder->blockEnd(false);
@@ -227,7 +263,7 @@ void WP4StructType::emit(CodeBuilder* builder) {
 
 void
 WP4StructType::declareArray(CodeBuilder* builder, cstring id, unsigned size) {
-    builder->appendFormat("%s %s[%d]", name.c_str(), id.c_str(), size);
+    builder->appendFormat("%s %s %s[%d]", kind.c_str(), name.c_str(), id.c_str(), size);
 }
 
 ///////////////////////////////////////////////////////////////
@@ -87,6 +87,9 @@ class WP4StackType : public WP4Type, public IHasWidth {
     void emitInitializer(CodeBuilder* builder) override;
     unsigned widthInBits() override;
     unsigned implementationWidthInBits() override;
+    unsigned getSize() const { return size; }
+    // The struct member next to the stack 'field' that holds its nextIndex
+    static cstring nextIndex(cstring field) { return WP4Model::reserved(field + "_next"); }
 };
 
 class WP4ScalarType : public WP4Type, public IHasWidth {
@@ -151,6 +154,23 @@ class WP4StructType : public WP4Type, public IHasWidth {
     void declareArray(CodeBuilder* builder, cstring id, unsigned size) override;
 };
 
+// A varbit field: storage for its maximum width.  Its header holds the
+// number of bits extracted in lengthField.
+class WP4VarbitType : public WP4Type, public IHasWidth {
+ public:
+    const unsigned maxWidth;
+    explicit WP4VarbitType(const IR::Type_Varbits* type) :
+            WP4Type(type), maxWidth(type->size) {}
+    void emit(CodeBuilder* builder) override
+    { builder->append("u8*"); }
+    void declare(CodeBuilder* builder, cstring id, bool asPointer) override;
+    void emitInitializer(CodeBuilder* builder) override
+    { builder->append("{ 0 }"); }
+    unsigned widthInBits() override { return maxWidth; }
+    unsigned implementationWidthInBits() override { return ROUNDUP(maxWidth, 8) * 8; }
+    static cstring lengthField() { return WP4Model::reserved("length"); }
+};
+
 class WP4EnumType : public WP4Type, public WP4::IHasWidth {
  public:
     explicit WP4EnumType(const IR::Type_Enum* type) : WP4Type(type) {}